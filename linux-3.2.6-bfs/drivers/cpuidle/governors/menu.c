@@ -120,6 +120,7 @@ struct menu_device {
 	u64		correction_factor[BUCKETS];
 	u32		intervals[INTERVALS];
 	int		interval_ptr;
+	int		injected;
 };
 
 
@@ -227,6 +228,44 @@ static void detect_repeating_patterns(struct menu_device *data)
 		data->predicted_us = avg;
 }
 
+/**
+ * menu_select_injected - selects the idle state for injected idle
+ * @drv: cpuidle driver containing state data
+ * @data: the menu state of the CPU
+ * @latency_req: the pm_qos latency constraint
+ * @inject_us: what is left of the injected idle window
+ * @min_state: the shallowest state the scheduler asked for
+ *
+ * Injected idle has a known length and is not a guess to be corrected, so
+ * go straight to the deepest state whose target residency fits in what is
+ * left of the window, and not shallower than @min_state. Only the latency
+ * constraint still limits the choice.
+ */
+static int menu_select_injected(struct cpuidle_driver *drv,
+				struct menu_device *data, int latency_req,
+				unsigned int inject_us, int min_state)
+{
+	int i;
+
+	data->expected_us = inject_us;
+	data->predicted_us = inject_us;
+	data->injected = 1;
+
+	for (i = CPUIDLE_DRIVER_STATE_START; i < drv->state_count; i++) {
+		struct cpuidle_state *s = &drv->states[i];
+
+		if (s->exit_latency > latency_req)
+			break;
+		if (s->target_residency > inject_us && i > min_state)
+			break;
+
+		data->last_state_idx = i;
+		data->exit_us = s->exit_latency;
+	}
+
+	return data->last_state_idx;
+}
+
 /**
  * menu_select - selects the next idle state to enter
  * @drv: cpuidle driver containing state data
@@ -240,6 +279,8 @@ static int menu_select(struct cpuidle_driver *drv, struct cpuidle_device *dev)
 	int i;
 	int multiplier;
 	struct timespec t;
+	unsigned int inject_us;
+	int min_state = 0;
 
 	if (data->needs_update) {
 		menu_update(drv, dev);
@@ -253,6 +294,12 @@ static int menu_select(struct cpuidle_driver *drv, struct cpuidle_device *dev)
 	if (unlikely(latency_req == 0))
 		return 0;
 
+	data->injected = 0;
+	inject_us = sched_idle_inject_hint(&min_state);
+	if (inject_us)
+		return menu_select_injected(drv, data, latency_req,
+					    inject_us, min_state);
+
 	/* determine the expected residency time, round up */
 	t = ktime_to_timespec(tick_nohz_get_sleep_length());
 	data->expected_us =
@@ -319,7 +366,8 @@ static void menu_reflect(struct cpuidle_device *dev, int index)
 {
 	struct menu_device *data = &__get_cpu_var(menu_devices);
 	data->last_state_idx = index;
-	if (index >= 0)
+	/* injected idle would only teach the predictor wrong residencies */
+	if (index >= 0 && !data->injected)
 		data->needs_update = 1;
 }
 
@@ -1111,6 +1111,30 @@ void thermal_zone_device_update(struct thermal_zone_device *tz)
 }
 EXPORT_SYMBOL(thermal_zone_device_update);
 
+/**
+ * thermal_zone_get_temp_by_id - read the temperature of a thermal zone
+ * @id:		the id of the zone, as in /sys/class/thermal/thermal_zone<id>
+ * @temp:	where the temperature is stored, in millidegrees Celsius
+ *
+ * For in-kernel users that poll a zone without holding a reference to it.
+ * Returns -ENODEV when no zone has that id.
+ */
+int thermal_zone_get_temp_by_id(int id, unsigned long *temp)
+{
+	struct thermal_zone_device *pos;
+	int ret = -ENODEV;
+
+	mutex_lock(&thermal_list_lock);
+	list_for_each_entry(pos, &thermal_tz_list, node)
+		if (pos->id == id) {
+			ret = pos->ops->get_temp(pos, temp);
+			break;
+		}
+	mutex_unlock(&thermal_list_lock);
+	return ret;
+}
+EXPORT_SYMBOL(thermal_zone_get_temp_by_id);
+
 /**
  * thermal_zone_device_register - register a new thermal zone device
  * @type:	the thermal zone device type
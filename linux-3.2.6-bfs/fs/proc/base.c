@@ -3075,6 +3075,7 @@ static const struct file_operations proc_hrm_consumer_measures_goal_ops = {
 	.llseek = generic_file_llseek,
 	.read = hrm_consumer_measures_goal_read,
 	.mmap = hrm_consumer_measures_goal_mmap,
+	.poll = hrm_consumer_measures_goal_poll,
 };
 #endif
 
@@ -12,6 +12,7 @@
 #include <asm/uaccess.h>
 #include <linux/hrm.h>
 #include <linux/init.h>
+#include <linux/poll.h>
 #include <linux/proc_fs.h>
 #include <linux/seq_file.h>
 #include <linux/sched.h>
@@ -197,28 +198,23 @@ int hrm_producer_counter_mmap(struct file* file, struct vm_area_struct *vma)
 	}
 
 	size = vma->vm_end - vma->vm_start;
-	if (size != counters->size) {
+	if (size != counters->size || vma->vm_pgoff != 0) {
 		printk(KERN_ERR __FILE__ " @ %d size not valid\n", __LINE__);
 		retval = -EINVAL;
 		goto failure_size;
 	}
-	retval = remap_pfn_range(vma, vma->vm_start, virt_to_phys((void *) counters->kernel_address) >> PAGE_SHIFT, size, vma->vm_page_prot);
-	if (retval < 0) {
-		printk(KERN_ERR __FILE__ " @ %d remap_pfn_range() failed\n", __LINE__);
-		goto failure_remap_pfn_range;
-	}
 	user_address = vma->vm_start;
 	retval = __hrm_add_group_memory_map(task, counters, user_address);
 	if (retval < 0) {
 		printk(KERN_ERR __FILE__ " @ %d __hrm_add_group_counters_map() failed\n", __LINE__);
 		goto failure_add_group_memory_map;
 	}
+	hrm_map_group_counters(vma, producer->group);
 
 exit:
 	producer->counter_user_address = HRM_COUNTER_ADDR(user_address,
 							producer->counter_index);
 failure_add_group_memory_map:
-failure_remap_pfn_range:
 failure_size:
 failure_get_group_memory_map:
 	write_unlock_irqrestore(&producer->group->members_lock, members_lock_flags);
@@ -300,27 +296,22 @@ int hrm_consumer_counter_mmap(struct file* file, struct vm_area_struct *vma)
 	}
 
 	size = vma->vm_end - vma->vm_start;
-	if (size != counters->size) {
+	if (size != counters->size || vma->vm_pgoff != 0) {
 		printk(KERN_ERR __FILE__ " @ %d size not valid\n", __LINE__);
 		retval = -EINVAL;
 		goto failure_size;
 	}
-	retval = remap_pfn_range(vma, vma->vm_start, virt_to_phys((void *) counters->kernel_address) >> PAGE_SHIFT, size, vma->vm_page_prot);
-	if (retval < 0) {
-		printk(KERN_ERR __FILE__ " @ %d remap_pfn_range() failed\n", __LINE__);
-		goto failure_remap_pfn_range;
-	}
 	user_address = vma->vm_start;
 	retval = __hrm_add_group_memory_map(task, counters, user_address);
 	if (retval < 0) {
 		printk(KERN_ERR __FILE__ " @ %d __hrm_add_group_counters_map() failed\n", __LINE__);
 		goto failure_add_group_memory_map;
 	}
+	hrm_map_group_counters(vma, consumer->group);
 
 exit:
 	consumer->counter_user_address = HRM_COUNTERS_ADDR(user_address);
 failure_add_group_memory_map:
-failure_remap_pfn_range:
 failure_size:
 failure_get_group_memory_map:
 	write_unlock_irqrestore(&consumer->group->members_lock, members_lock_flags);
@@ -457,6 +448,9 @@ ssize_t hrm_consumer_measures_goal_read(struct file *file, char __user *buf, siz
 	}
 
 	consumer = list_first_entry(&task->hrm_consumers, struct hrm_consumer, task_link);
+	hrm_resume_group(consumer->group);
+	/* reading acknowledges the events reported by poll() */
+	consumer->events_seen = ACCESS_ONCE(consumer->group->events);
 	ksize = snprintf(kbuf, 1024, "%lu %lu", consumer->measures_user_address, consumer->goal_user_address);
 	retval = simple_read_from_buffer(buf, size, off, kbuf, ksize);
 
@@ -537,6 +531,39 @@ failure_task_not_valid:
 	return retval;
 }
 
+unsigned int hrm_consumer_measures_goal_poll(struct file *file, poll_table *wait)
+{
+	unsigned int retval = 0;
+	struct task_struct *task;
+	struct hrm_consumer *consumer;
+
+	task = get_proc_task(file->f_dentry->d_inode);
+
+	if (task != current) {
+		printk(KERN_ERR __FILE__ " @ %d task %d not valid\n", __LINE__, (int) task->pid);
+		retval = POLLERR;
+		goto failure_task_not_valid;
+	}
+
+	if (!hrm_consumer_task_enabled(task)) {
+		printk(KERN_ERR __FILE__ " @ %d task %d not enabled\n", __LINE__, (int) task->pid);
+		retval = POLLERR;
+		goto failure_task_not_enabled;
+	}
+
+	consumer = list_first_entry(&task->hrm_consumers, struct hrm_consumer, task_link);
+	poll_wait(file, &hrm_events_wait, wait);
+	hrm_resume_group(consumer->group);
+	if (ACCESS_ONCE(consumer->group->events) != consumer->events_seen)
+		retval = POLLIN | POLLRDNORM | POLLPRI;
+
+failure_task_not_enabled:
+failure_task_not_valid:
+	put_task_struct(task);
+
+	return retval;
+}
+
 static int hrm_show(struct seq_file *seq_file, void *v)
 {
 	struct hrm_group *group;
@@ -584,6 +611,15 @@ static int hrm_show(struct seq_file *seq_file, void *v)
 				(unsigned long long) max, HRM_MEASURE_SCALE,
 				scope,
 				(unsigned long) hr, HRM_MEASURE_SCALE);
+		seq_printf(seq_file, "heartbeat gap p50/p99/p999: "
+				"%llu/%llu/%llu [ns]\n",
+				(unsigned long long) measures->gap_p50,
+				(unsigned long long) measures->gap_p99,
+				(unsigned long long) measures->gap_p999);
+#ifdef CONFIG_HRM_IDLE_INJECT
+		seq_printf(seq_file, "injected idle: %d [1/1000]\n",
+				group->inject_permille);
+#endif
 
 		for (i = 1; i <= HRM_MAX_WINDOWS; i++) {
 			hr = hrm_get_heart_rate(group, &scope, i);
@@ -595,6 +631,19 @@ static int hrm_show(struct seq_file *seq_file, void *v)
 					(unsigned long long) hr, HRM_MEASURE_SCALE,
 					(unsigned int) scope);
 		}
+		for (i = 0; i < HRM_MAX_EWMAS; i++) {
+			if (goal->ewma_half_life[i])
+				seq_printf(seq_file, "ewma %d\n"
+					"\tsmoothed heart rate: %llu [hb/%d / s]\n"
+					"\ttrend: %lld [hb/%d / s^2]\n"
+					"\thalf-life: %u\n",
+					i + 1,
+					(unsigned long long) measures->ewma[i].rate,
+					HRM_MEASURE_SCALE,
+					(long long) measures->ewma[i].trend,
+					HRM_MEASURE_SCALE,
+					goal->ewma_half_life[i]);
+		}
 	}
 	spin_unlock(&hrm_groups_lock);
 	return 0;
@@ -13,6 +13,10 @@
 
 #define HRM_MAX_WINDOWS 32
 #define HRM_MEASURE_SCALE 1000
+#define HRM_MIN_TIMER_PERIOD 100
+#define HRM_MAX_TIMER_PERIOD 1000000
+#define HRM_GAP_BUCKETS 128
+#define HRM_MAX_EWMAS 4
 
 #ifndef __KERNEL__
 #define NSEC_PER_SEC 1000000000
@@ -35,9 +39,41 @@ struct hrm_measure {
 	u64 time;
 };
 
+/*
+ * Heart rate smoothed with the half-life in goal->ewma_half_life and its
+ * trend, both scaled by HRM_MEASURE_SCALE: rate in [hb/s], trend in
+ * [hb/s per s].
+ */
+struct hrm_ewma {
+	u64 rate;
+	s64 trend;
+};
+
+/*
+ * seq is odd while the kernel rewrites the measures: readers retry when it
+ * is odd or changed across their read.
+ */
 struct hrm_measures {
+	u32 seq;
+	u64 counters; /* counter slots backed by pages, see hrm_get_tids() */
 	struct hrm_measure global;
 	struct hrm_measure window[HRM_MAX_WINDOWS];
+	struct hrm_ewma ewma[HRM_MAX_EWMAS];
+
+	/* percentiles of the gaps in the goal scope [ns], see struct hrm_gaps */
+	u64 gap_p50;
+	u64 gap_p99;
+	u64 gap_p999;
+};
+
+/*
+ * Histogram of the gaps between consecutive heartbeats of each producer,
+ * right after struct hrm_measures in the same page. Producers count their
+ * gaps in microseconds: gaps below 4 us have a bucket each, then every
+ * power of two is split in four buckets.
+ */
+struct hrm_gaps {
+	u64 bucket[HRM_GAP_BUCKETS];
 };
 
 struct hrm_goal {
@@ -45,8 +81,12 @@ struct hrm_goal {
 	u64 min_heart_rate;
 	u64 max_heart_rate;
 	size_t scope;
+	u64 period_us; /* sampling period, 0 for the default */
+	u64 notify_threshold; /* heart rate change that wakes consumers */
+	u64 max_gap_p99; /* [ns], 0 for none */
 
 	size_t window_size[HRM_MAX_WINDOWS];
+	u32 ewma_half_life[HRM_MAX_EWMAS]; /* [periods], 0 for unused */
 };
 
 #ifdef __KERNEL__
@@ -54,27 +94,36 @@ struct hrm_goal {
 #include <asm/cache.h>
 #include <linux/fs.h>
 #include <linux/hrtimer.h>
+#include <linux/kref.h>
 #include <linux/list.h>
 #include <linux/mm.h>
+#include <linux/seqlock.h>
 #include <linux/spinlock.h>
 #include <linux/time.h>
 #include <linux/types.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 #define HRM_PAGE_GROUP_SIZE (PAGE_SIZE / L1_CACHE_BYTES)
 
-#define HRM_GROUP_ORDER (CONFIG_HRM_GROUP_ORDER)
-#define HRM_GROUP_SIZE ((1 << HRM_GROUP_ORDER) * HRM_PAGE_GROUP_SIZE)
+#define HRM_GROUP_MAX_PAGES (CONFIG_HRM_GROUP_MAX_PAGES)
+#define HRM_GROUP_MAX_SIZE (HRM_GROUP_MAX_PAGES * HRM_PAGE_GROUP_SIZE)
 #define HRM_MAX_WINDOW_SIZE (1 << CONFIG_HRM_MAX_WINDOW_SIZE)
 #define HRM_TIMER_PERIOD (CONFIG_HRM_TIMER_PERIOD)
+#define HRM_MIN_WINDOW_SIZE 2
+#define HRM_NO_SLACK INT_MAX
 
 #define HRM_COUNTER_ADDR(address, index) ((unsigned long) (address) + L1_CACHE_BYTES * (index))
 #define HRM_COUNTERS_ADDR(address) ((unsigned long) (address))
 #define HRM_MEASURES_ADDR(address) ((unsigned long) (address))
+#define HRM_GAPS_ADDR(address) ((unsigned long) (address) + \
+	sizeof(struct hrm_measures))
 #define HRM_GOAL_ADDR(address) ((unsigned long) (address) + PAGE_SIZE - \
 	sizeof(struct hrm_goal))
 
 extern struct list_head hrm_groups;
 extern spinlock_t hrm_groups_lock;
+extern wait_queue_head_t hrm_events_wait;
 
 struct hrm_memory {
 	unsigned long kernel_address;
@@ -83,6 +132,23 @@ struct hrm_memory {
 	struct list_head maps;
 };
 
+/*
+ * Per-cpu sampling engine: one timer samples every active group resumed on
+ * that cpu, each on its own period, and stops when none is left. It fires
+ * with a tenth of the shortest period as slack to coalesce with the other
+ * timers of the cpu.
+ */
+struct hrm_engine {
+	spinlock_t lock;
+	struct hrtimer timer;
+	struct list_head groups;
+};
+
+struct hrm_sample {
+	u64 counter;
+	struct timespec elapsed_time;
+};
+
 struct hrm_window_span {
 		int begin;
 		int end;
@@ -94,28 +160,115 @@ struct hrm_group {
 	struct hrm_memory counters;
 	struct hrm_memory measures_goal;
 
+	/*
+	 * Kernel readers of the measures use this copy of measures->seq, the
+	 * one in the shared page can be written by user space.
+	 */
+	seqcount_t measures_seq;
+
 	struct {
 		int window_cur;
 		int buffered;
 
-		struct {
-			u64 counter;
-			struct timespec elapsed_time;
-		} window[HRM_MAX_WINDOW_SIZE];
+		/* ring of size entries, grown to fit the largest window */
+		int size;
+		struct hrm_sample *window;
+
+		/*
+		 * A ring of spare_size entries allocated by grow_work for
+		 * the timer to switch to, under the members_lock; grow is
+		 * the size the timer asked for.
+		 */
+		int grow;
+		int spare_size;
+		struct hrm_sample *spare;
+		struct work_struct grow_work;
 
 		u64 history;
 	} history;
 
-	DECLARE_BITMAP(counters_allocation, HRM_GROUP_SIZE);
-
-	struct hrtimer timer;
+	/*
+	 * Counter pages are allocated one at a time as producers join and
+	 * are faulted into the mappings of counters, which reserve
+	 * HRM_GROUP_MAX_PAGES pages; counters_allocation covers the
+	 * allocated pages only.
+	 */
+	struct page **counters_pages;
+	int counters_nr_pages;
+	unsigned long *counters_allocation;
+
+	/*
+	 * Held by the group list and by each mapping of counters: a mapping
+	 * that outlives the group keeps faulting in the pages of this group.
+	 */
+	struct kref ref;
+
+	/*
+	 * Heartbeats of the live producers folded by the cpu that ran them,
+	 * see hrm_fold_task(); the exited ones are in history.history.
+	 */
+	u64 __percpu *partial;
+
+	/*
+	 * A group whose heartbeats did not change for as many periods as its
+	 * largest window is suspended and leaves its engine; it is resumed on
+	 * the cpu that next folds a heartbeat or reads it.
+	 */
+	int suspended;
+	size_t quiet;
+	ktime_t next_sample;
+	struct hrm_engine *engine;
+	struct list_head engine_link;
 
 	struct timespec timestamp;
 
+	/*
+	 * Events wake the consumers polling hrm_consumer_measures_goal, see
+	 * __hrm_notify_group().
+	 */
+	u64 events;
+	int goal_missed;
+	u64 notified_hr[HRM_MAX_WINDOWS];
+
+	/*
+	 * Gaps counted by the producers up to the last sample and their
+	 * histogram decayed over the goal scope, see __hrm_update_gaps().
+	 */
+	u64 gaps_seen[HRM_GAP_BUCKETS];
+	u64 gaps_decayed[HRM_GAP_BUCKETS];
+
+	/*
+	 * Smoothed heart rates: last sample, and per estimator the half-life
+	 * its decay was computed for, the level and the per period trend.
+	 */
+	struct {
+		u64 count;
+		u64 time;
+
+		u32 half_life[HRM_MAX_EWMAS];
+		u32 decay[HRM_MAX_EWMAS];
+		s64 level[HRM_MAX_EWMAS];
+		s64 trend[HRM_MAX_EWMAS];
+	} ewma;
+
 	struct list_head producers;
 	struct list_head consumers;
 	rwlock_t members_lock;
 
+#ifdef CONFIG_HRM_IDLE_INJECT
+	int inject_permille;
+#endif
+
+	/*
+	 * Distance of the heart rate in the goal scope from the goal in per
+	 * mille of the bound it crossed, negative below min_heart_rate and
+	 * positive above max_heart_rate, within +-1000, or HRM_NO_SLACK; 0
+	 * inside the goal; read locklessly
+	 * through task_struct.hrm_group, see hrm_task_slack().
+	 */
+	int slack;
+	struct rcu_head rcu;
+
 	struct list_head link;
 };
 
@@ -130,6 +283,8 @@ struct hrm_producer {
 
 	struct hrm_group *group;
 
+	u64 folded;
+
 	unsigned long counter_user_address;
 	unsigned long measures_user_address;
 	unsigned long goal_user_address;
@@ -141,6 +296,8 @@ struct hrm_producer {
 struct hrm_consumer {
 	struct hrm_group *group;
 
+	u64 events_seen;
+
 	unsigned long counter_user_address;
 	unsigned long measures_user_address;
 	unsigned long goal_user_address;
@@ -149,6 +306,43 @@ struct hrm_consumer {
 	struct list_head group_link;
 };
 
+void __hrm_fold_task(struct task_struct *task);
+void __hrm_resume_group(struct hrm_group *group);
+
+static inline void hrm_resume_group(struct hrm_group *group)
+{
+	if (unlikely(group->suspended))
+		__hrm_resume_group(group);
+}
+
+/*
+ * Called with interrupts disabled by the cpu running task, at the tick and
+ * when it schedules: only task itself changes its producer list. A macro as
+ * this header is included before struct task_struct is defined.
+ */
+#define hrm_fold_task(task)						\
+	do {								\
+		if (unlikely(!list_empty(&(task)->hrm_producers)))	\
+			__hrm_fold_task(task);				\
+	} while (0)
+
+/*
+ * Goal slack of the group task last joined as a producer, HRM_NO_SLACK if
+ * none: safe from the scheduler, groups are freed after a grace period.
+ */
+#define hrm_task_slack(task)						\
+	({								\
+		struct hrm_group *__group;				\
+		int __slack = HRM_NO_SLACK;				\
+									\
+		rcu_read_lock();					\
+		__group = rcu_dereference((task)->hrm_group);		\
+		if (__group)						\
+			__slack = ACCESS_ONCE(__group->slack);		\
+		rcu_read_unlock();					\
+		__slack;						\
+	})
+
 struct hrm_producer *__hrm_find_producer_struct(struct task_struct *task,
 								int gid);
 int hrm_add_producer_task_to_group(struct task_struct *task, int gid);
@@ -180,6 +374,9 @@ ssize_t hrm_consumer_group_write(struct file *file, const char __user *buf,
 						size_t size, loff_t *off);
 ssize_t hrm_producer_counter_read(struct file *file, char __user *buf,
 						size_t size, loff_t *off);
+void hrm_map_group_counters(struct vm_area_struct *vma,
+					struct hrm_group *group);
+
 int hrm_producer_counter_mmap(struct file* file, struct vm_area_struct *vma);
 ssize_t hrm_consumer_counter_read(struct file *file, char __user *buf,
 						size_t size, loff_t *off);
@@ -192,6 +389,8 @@ ssize_t hrm_consumer_measures_goal_read(struct file *file, char __user *buf,
 						size_t size, loff_t *off);
 int hrm_consumer_measures_goal_mmap(struct file* file,
 						struct vm_area_struct *vma);
+unsigned int hrm_consumer_measures_goal_poll(struct file *file,
+						struct poll_table_struct *wait);
 
 /* Kernelspace consumer API */
 u64
@@ -525,6 +525,23 @@ struct thread_group_cputimer {
 #include <linux/rwsem.h>
 struct autogroup;
 
+#ifdef CONFIG_SCHED_BFS
+/*
+ * Idle injection budget of a thread or a whole thread group: once every
+ * max_load times it would be picked, the cpu runs idle instead ('i' mode) or
+ * the next best task ('s'kip mode). A max_load of 0 leaves it alone. times
+ * only changes under grq.lock. hrm_max_load is the 'i' mode budget of the
+ * HRM idle injection policy, kept apart from the one set by the
+ * administrator: the stricter of the two applies.
+ */
+struct sched_throttle {
+	int max_load;
+	int hrm_max_load;
+	int times;
+	char mode;
+};
+#endif
+
 /*
  * NOTE! "signal_struct" does not have its own
  * locking, because a shared signal_struct always
@@ -661,6 +678,9 @@ struct signal_struct {
 	struct mutex cred_guard_mutex;	/* guard against foreign influences on
 					 * credential calculations
 					 * (notably. ptrace) */
+#ifdef CONFIG_SCHED_BFS
+	struct sched_throttle throttle;	/* shared by the whole thread group */
+#endif
 };
 
 /* Context switch must be unlocked if interrupts are to be enabled */
@@ -1072,6 +1092,7 @@ struct uts_namespace;
 
 struct rq;
 struct sched_domain;
+struct edf_queue;
 
 /*
  * wake flags
@@ -1249,12 +1270,18 @@ struct task_struct {
 	int time_slice;
 	u64 deadline;
 	struct list_head run_list;
+	struct rb_node deadline_node; /* Non rt tasks only, keyed by deadline */
 	u64 last_ran;
 	u64 sched_time; /* sched_clock time spent running */
 #ifdef CONFIG_SMP
 	bool sticky; /* Soft affined flag */
 #endif
 	unsigned long rt_timeout;
+	struct sched_throttle throttle;
+	u64 throttle_skip; /* grq pick that skipped it over */
+#ifdef CONFIG_SMP
+	struct edf_queue *edf; /* Queue holding run_list */
+#endif
 #else /* CONFIG_SCHED_BFS */
 	const struct sched_class *sched_class;
 	struct sched_entity se;
@@ -1603,6 +1630,7 @@ struct task_struct {
 #ifdef CONFIG_HRM
 	struct list_head hrm_producers;
 	struct list_head hrm_consumers;
+	struct hrm_group __rcu *hrm_group;
 #endif
 };
 
@@ -1612,6 +1640,7 @@ void grq_unlock_wait(void);
 void cpu_scaling(int cpu);
 void cpu_nonscaling(int cpu);
 int above_background_load(void);
+unsigned int sched_idle_inject_hint(int *min_state);
 #define tsk_seruntime(t)		((t)->sched_time)
 #define tsk_rttimeout(t)		((t)->rt_timeout)
 
@@ -1665,6 +1694,11 @@ static inline int above_background_load(void)
 {
 	return 1;
 }
+
+static inline unsigned int sched_idle_inject_hint(int *min_state)
+{
+	return 0;
+}
 #endif /* CONFIG_SCHED_BFS */
 
 /* Future-safe accessor for struct task_struct's cpus_allowed. */
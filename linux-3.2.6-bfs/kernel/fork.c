@@ -1374,6 +1374,7 @@ static struct task_struct *copy_process(unsigned long clone_flags,
 #ifdef CONFIG_HRM
 	INIT_LIST_HEAD(&p->hrm_producers);
 	INIT_LIST_HEAD(&p->hrm_consumers);
+	RCU_INIT_POINTER(p->hrm_group, NULL);
 #endif
 
 	total_forks++;
@@ -10,8 +10,11 @@
  */
 #include <asm/mman.h>
 #include <linux/err.h>
+#include <linux/kernel.h>
 #include <linux/ktime.h>
+#include <linux/log2.h>
 #include <linux/math64.h>
+#include <linux/percpu.h>
 #include <linux/sched.h>
 #include <linux/slab.h>
 
@@ -28,41 +31,439 @@ struct hrm_memory_map {
 
 LIST_HEAD(hrm_groups);
 DEFINE_SPINLOCK(hrm_groups_lock);
+DECLARE_WAIT_QUEUE_HEAD(hrm_events_wait);
 
-static enum hrtimer_restart __hrm_update_group_measures(struct hrtimer *timer)
+static inline u64 __hrm_compute_hr(u64 count, u64 time)
+{
+	u64 scaled_time, scaled_count;
+
+	scaled_count = count * USEC_PER_SEC;
+	scaled_time = div64_u64(MSEC_PER_SEC, HRM_MEASURE_SCALE);
+	scaled_time = div64_u64(time, scaled_time);
+
+	return div64_u64(scaled_count, scaled_time);
+}
+
+static struct hrm_measure *__hrm_goal_measure(struct hrm_measures *measures,
+						struct hrm_goal *goal)
+{
+	int i;
+
+	for (i = 0; goal->scope && i < HRM_MAX_WINDOWS; i++)
+		if (goal->window_size[i] == goal->scope)
+			return &measures->window[i];
+
+	return &measures->global;
+}
+
+/*
+ * Consumers are woken when the heart rate in the goal scope leaves or
+ * re-enters the goal, and when the heart rate of a window moved by more
+ * than goal->notify_threshold since that window last woke them. All the
+ * groups share hrm_events_wait: pollers are few and events are at most
+ * one per period.
+ * Returns whether the consumers are to be woken: the engine does it once its
+ * lock is released, as the scheduler takes the engine lock with grq.lock held
+ * (see __hrm_resume_group()) while waking up takes grq.lock.
+ */
+static int __hrm_notify_group(struct hrm_group *group,
+		struct hrm_measures *measures, struct hrm_goal *goal)
+{
+	struct hrm_measure *measure;
+	u64 threshold = goal->notify_threshold;
+	u64 hr, delta;
+	int missed = 0;
+	int notify = 0;
+	int i;
+
+	measure = __hrm_goal_measure(measures, goal);
+	if (measure->time) {
+		hr = __hrm_compute_hr(measure->count, measure->time);
+		missed = (goal->min_heart_rate && hr < goal->min_heart_rate) ||
+			(goal->max_heart_rate && hr > goal->max_heart_rate);
+	}
+	if (goal->max_gap_p99 && measures->gap_p99 > goal->max_gap_p99)
+		missed = 1;
+	if (missed != group->goal_missed) {
+		group->goal_missed = missed;
+		notify = 1;
+	}
+
+	for (i = 0; threshold && i < HRM_MAX_WINDOWS; i++) {
+		if (!goal->window_size[i] || !measures->window[i].time)
+			continue;
+		hr = __hrm_compute_hr(measures->window[i].count,
+						measures->window[i].time);
+		if (hr > group->notified_hr[i])
+			delta = hr - group->notified_hr[i];
+		else
+			delta = group->notified_hr[i] - hr;
+		if (delta > threshold) {
+			group->notified_hr[i] = hr;
+			notify = 1;
+		}
+	}
+
+	if (notify)
+		group->events++;
+	return notify;
+}
+
+#ifdef CONFIG_HRM_IDLE_INJECT
+/*
+ * Idle injection policy: the producers of a group with a minimum heart rate
+ * goal are throttled (see struct sched_throttle) with as much idle as the
+ * goal allows. The idle share grows by HRM_INJECT_STEP per mille every
+ * period the heart rate in the goal scope meets the minimum and is halved
+ * in the very period it does not. HRM_INJECT_MAX keeps hrm_max_load >= 5.
+ * A suspended group gets no measure that could lift the throttle, so its
+ * producers are released when it is suspended and the policy starts over
+ * from no idle with the first sample after it is resumed.
+ */
+#define HRM_INJECT_STEP 5
+#define HRM_INJECT_MAX 200
+
+/* Leaves alone any throttle set through /proc/schedidle/sched_pid */
+static void __hrm_set_throttle(struct hrm_producer *producer, int permille)
+{
+	struct sched_throttle *throttle = &producer->task->throttle;
+
+	throttle->hrm_max_load = permille ? 1000 / permille : 0;
+}
+
+static void __hrm_inject_idle(struct hrm_group *group,
+		struct hrm_measures *measures, struct hrm_goal *goal)
+{
+	struct hrm_producer *producer;
+	struct hrm_measure *measure;
+	int permille = 0;
+
+	if (goal->min_heart_rate || goal->max_gap_p99) {
+		measure = __hrm_goal_measure(measures, goal);
+		if (!measure->time)
+			return;
+
+		if (__hrm_compute_hr(measure->count, measure->time) <
+							goal->min_heart_rate ||
+		    (goal->max_gap_p99 &&
+				measures->gap_p99 > goal->max_gap_p99))
+			permille = group->inject_permille / 2;
+		else
+			permille = min(group->inject_permille + HRM_INJECT_STEP,
+							HRM_INJECT_MAX);
+	}
+	if (permille == group->inject_permille)
+		return;
+
+	group->inject_permille = permille;
+	list_for_each_entry (producer, &group->producers, group_link) {
+		__hrm_set_throttle(producer, permille);
+	}
+}
+
+/* Releases the producers of a group being suspended, members_lock held */
+static void __hrm_stop_inject(struct hrm_group *group)
+{
+	struct hrm_producer *producer;
+
+	if (!group->inject_permille)
+		return;
+
+	group->inject_permille = 0;
+	list_for_each_entry (producer, &group->producers, group_link) {
+		__hrm_set_throttle(producer, 0);
+	}
+}
+#endif
+
+static DEFINE_PER_CPU(struct hrm_engine, hrm_engines);
+
+static void __hrm_release_group(struct kref *ref);
+
+static size_t __hrm_largest_window(struct hrm_goal *goal)
+{
+	size_t ws = goal->scope;
+	int i;
+
+	for (i = 0; i < HRM_MAX_WINDOWS; i++)
+		if (goal->window_size[i] > ws)
+			ws = goal->window_size[i];
+
+	return clamp_t(size_t, ws, 1, HRM_MAX_WINDOW_SIZE);
+}
+
+static u64 __hrm_group_period(struct hrm_group *group)
+{
+	struct hrm_goal *goal;
+	u64 period;
+
+	goal = (struct hrm_goal *) HRM_GOAL_ADDR(group->measures_goal.kernel_address);
+	period = goal->period_us;
+	if (period == 0)
+		return HRM_TIMER_PERIOD;
+
+	return clamp_t(u64, period, HRM_MIN_TIMER_PERIOD, HRM_MAX_TIMER_PERIOD);
+}
+
+/*
+ * Grows the history ring so that it holds ws samples besides the current
+ * one, keeping the buffered ones in order. In timer context, the ring is
+ * allocated by grow_work: until it is ready the windows stay clamped to
+ * the current ring.
+ */
+static void __hrm_grow_history(struct hrm_group *group, size_t ws)
+{
+	int size = min_t(size_t, roundup_pow_of_two(ws + 1), HRM_MAX_WINDOW_SIZE);
+	struct hrm_sample *window;
+	int first;
+	int i;
+
+	if (size <= group->history.size)
+		return;
+
+	window = group->history.spare;
+	if (window == NULL || group->history.spare_size < size) {
+		ACCESS_ONCE(group->history.grow) = size;
+		kref_get(&group->ref);
+		if (!schedule_work(&group->history.grow_work))
+			kref_put(&group->ref, __hrm_release_group);
+		return;
+	}
+	size = group->history.spare_size;
+	group->history.spare = NULL;
+	group->history.spare_size = 0;
+
+	first = group->history.window_cur - group->history.buffered;
+	for (i = 0; i < group->history.buffered; i++)
+		window[i] = group->history.window[(first + i) &
+						(group->history.size - 1)];
+	kfree(group->history.window);
+	group->history.window = window;
+	group->history.size = size;
+	group->history.window_cur = group->history.buffered;
+}
+
+#define HRM_GAP_SHIFT 10
+
+/* Upper bound of a bucket of struct hrm_gaps [ns] */
+static u64 __hrm_gap_limit(int bucket)
+{
+	if (bucket < 4)
+		return (bucket + 1) * NSEC_PER_USEC;
+
+	return ((u64) (5 + bucket % 4) << (bucket / 4 - 1)) * NSEC_PER_USEC;
+}
+
+/*
+ * Folds the gaps the producers counted since the last sample into a
+ * histogram that loses 1/2^k of its weight every period, 2^k being the goal
+ * scope rounded down (nothing with a global goal), and publishes its
+ * percentiles as the upper bounds of their buckets.
+ */
+static void __hrm_update_gaps(struct hrm_group *group,
+		struct hrm_measures *measures, struct hrm_goal *goal)
+{
+	static const u32 tail[] = { 2, 100, 1000 };
+	u64 *percentile[] = {
+		&measures->gap_p50, &measures->gap_p99, &measures->gap_p999
+	};
+	struct hrm_gaps *gaps;
+	u64 *decayed = group->gaps_decayed;
+	size_t scope = goal->scope;
+	u64 count, total = 0, sum = 0;
+	int shift = scope ? ilog2(min_t(size_t, scope, HRM_MAX_WINDOW_SIZE)) : -1;
+	int i, p = 0;
+
+	gaps = (struct hrm_gaps *) HRM_GAPS_ADDR(group->measures_goal.kernel_address);
+	for (i = 0; i < HRM_GAP_BUCKETS; i++) {
+		count = ACCESS_ONCE(gaps->bucket[i]);
+		if (shift >= 0)
+			decayed[i] -= decayed[i] >> shift;
+		decayed[i] += (count - group->gaps_seen[i]) << HRM_GAP_SHIFT;
+		group->gaps_seen[i] = count;
+		total += decayed[i];
+	}
+
+	for (i = 0; i < HRM_GAP_BUCKETS && p < ARRAY_SIZE(tail); i++) {
+		sum += decayed[i];
+		while (total && p < ARRAY_SIZE(tail) &&
+				total - sum <= div_u64(total, tail[p]))
+			*percentile[p++] = __hrm_gap_limit(i);
+	}
+	while (p < ARRAY_SIZE(tail))
+		*percentile[p++] = 0;
+}
+
+#define HRM_EWMA_SHIFT 16
+#define HRM_EWMA_ONE (1 << HRM_EWMA_SHIFT)
+
+/* 2^(-1/half_life) in fixed point, bisecting on decay^half_life = 1/2 */
+static u32 __hrm_ewma_decay(u32 half_life)
+{
+	u32 lo = 0, hi = HRM_EWMA_ONE, mid, e;
+	u64 pow, base;
+
+	while (hi - lo > 1) {
+		mid = (lo + hi) / 2;
+		pow = HRM_EWMA_ONE;
+		base = mid;
+		for (e = half_life; e; e >>= 1) {
+			if (e & 1)
+				pow = (pow * base) >> HRM_EWMA_SHIFT;
+			base = (base * base) >> HRM_EWMA_SHIFT;
+		}
+		if (pow > HRM_EWMA_ONE / 2)
+			hi = mid;
+		else
+			lo = mid;
+	}
+
+	return lo;
+}
+
+/*
+ * Double exponential smoothing of the heart rate over the last period: the
+ * level and the trend decay by half every half-life periods, in O(1) per
+ * sample and without any history. An estimator restarts from the current
+ * rate whenever its half-life changes.
+ */
+static void __hrm_update_ewmas(struct hrm_group *group,
+		struct hrm_measures *measures, struct hrm_goal *goal,
+		u64 heartbeats, u64 time)
+{
+	u64 count = heartbeats - group->ewma.count;
+	u64 elapsed = time - group->ewma.time;
+	s64 rate, level, trend, decay, alpha;
+	u32 half_life;
+	int i;
+
+	if (!group->ewma.time || !elapsed)
+		goto exit;
+	rate = __hrm_compute_hr(count, elapsed);
+
+	for (i = 0; i < HRM_MAX_EWMAS; i++) {
+		half_life = min_t(u32, goal->ewma_half_life[i],
+						HRM_MAX_WINDOW_SIZE);
+		if (half_life != group->ewma.half_life[i]) {
+			group->ewma.half_life[i] = half_life;
+			group->ewma.decay[i] = __hrm_ewma_decay(half_life);
+			group->ewma.level[i] = rate;
+			group->ewma.trend[i] = 0;
+		}
+		if (!half_life) {
+			measures->ewma[i].rate = 0;
+			measures->ewma[i].trend = 0;
+			continue;
+		}
+
+		decay = group->ewma.decay[i];
+		alpha = HRM_EWMA_ONE - decay;
+		level = group->ewma.level[i];
+		trend = group->ewma.trend[i];
+		group->ewma.level[i] = (alpha * rate +
+				decay * (level + trend)) >> HRM_EWMA_SHIFT;
+		group->ewma.trend[i] = (alpha * (group->ewma.level[i] - level) +
+				decay * trend) >> HRM_EWMA_SHIFT;
+
+		measures->ewma[i].rate = max_t(s64, group->ewma.level[i], 0);
+		measures->ewma[i].trend = div64_s64(group->ewma.trend[i] *
+				USEC_PER_SEC, max_t(u64, elapsed / NSEC_PER_USEC, 1));
+	}
+
+exit:
+	group->ewma.count = heartbeats;
+	group->ewma.time = time;
+}
+
+/*
+ * Distance of the heart rate in the goal scope from the goal, normalized to
+ * the bound it crossed: negative below the minimum heart rate, positive above
+ * the maximum one and 0 in between. No goal or no measure yet leave the group
+ * with HRM_NO_SLACK.
+ */
+static void __hrm_update_slack(struct hrm_group *group,
+		struct hrm_measures *measures, struct hrm_goal *goal)
+{
+	struct hrm_measure *measure = __hrm_goal_measure(measures, goal);
+	u64 min_hr = goal->min_heart_rate;
+	u64 max_hr = goal->max_heart_rate;
+	s64 slack = 0;
+	u64 hr;
+
+	if ((!min_hr && !max_hr) || !measure->time) {
+		ACCESS_ONCE(group->slack) = HRM_NO_SLACK;
+		return;
+	}
+
+	hr = __hrm_compute_hr(measure->count, measure->time);
+	if (min_hr && hr < min_hr)
+		slack = div64_s64(((s64) hr - (s64) min_hr) * 1000, min_hr);
+	else if (max_hr && hr > max_hr)
+		slack = div64_s64(((s64) hr - (s64) max_hr) * 1000, max_hr);
+	ACCESS_ONCE(group->slack) = clamp_t(s64, slack, -1000, 1000);
+}
+
+static void __hrm_begin_measures_update(struct hrm_group *group,
+					struct hrm_measures *measures)
+{
+	write_seqcount_begin(&group->measures_seq);
+	ACCESS_ONCE(measures->seq) = group->measures_seq.sequence;
+	smp_wmb();
+}
+
+static void __hrm_end_measures_update(struct hrm_group *group,
+					struct hrm_measures *measures)
+{
+	smp_wmb();
+	ACCESS_ONCE(measures->seq) = group->measures_seq.sequence + 1;
+	write_seqcount_end(&group->measures_seq);
+}
+
+/*
+ * Returns whether the group is still beating, and in notify whether its
+ * consumers have to be woken.
+ */
+static int __hrm_update_group_measures(struct hrm_group *group, int *notify)
 {
-	struct hrm_group *group;
 	struct hrm_measures *measures;
 	struct hrm_goal *goal;
 	unsigned long members_lock_flags;
 	struct timespec current_time;
 	u64 heartbeats = 0;
-	struct hrm_producer *producer;
 	struct timespec elapsed_time, elapsed_time_w;
 	u64 heartbeats_w = 0;
-	size_t ws;
+	size_t ws, largest_ws;
 	int window_first;
+	int cpu;
 	int i;
 
-	group = container_of(timer, struct hrm_group, timer);
 	measures = (struct hrm_measures *) HRM_MEASURES_ADDR(group->measures_goal.kernel_address);
 	goal = (struct hrm_goal *) HRM_GOAL_ADDR(group->measures_goal.kernel_address);
 
 	read_lock_irqsave(&group->members_lock, members_lock_flags);
 
-	hrtimer_start(&group->timer, ktime_set(0, (unsigned long)
-			NSEC_PER_USEC * HRM_TIMER_PERIOD), HRTIMER_MODE_REL);
+	largest_ws = __hrm_largest_window(goal);
+	__hrm_grow_history(group, largest_ws);
+
+	__hrm_begin_measures_update(group, measures);
 
 	getrawmonotonic(&current_time);
 	elapsed_time = timespec_sub(current_time, group->timestamp);
 	measures->global.time = (u64) timespec_to_ns(&elapsed_time);
 
 	heartbeats = group->history.history;
-	list_for_each_entry (producer, &group->producers, group_link) {
-		heartbeats += producer->counter->counter;
-	}
+	for_each_possible_cpu(cpu)
+		heartbeats += *per_cpu_ptr(group->partial, cpu);
+	if (heartbeats != measures->global.count)
+		group->quiet = 0;
+	else
+		group->quiet++;
 	measures->global.count = heartbeats;
 
+	__hrm_update_gaps(group, measures, goal);
+	__hrm_update_ewmas(group, measures, goal, heartbeats,
+						measures->global.time);
+
 	group->history.window[group->history.window_cur].counter = heartbeats;
 	group->history.window[group->history.window_cur].elapsed_time = elapsed_time;
 
@@ -74,10 +475,12 @@ static enum hrtimer_restart __hrm_update_group_measures(struct hrtimer *timer)
 		if (ws != 0) {
 			if (ws > group->history.buffered)
 				ws = group->history.buffered;
+			if (ws >= group->history.size)
+				ws = group->history.size - 1;
 
 			window_first =
 				(group->history.window_cur - ws) &
-							(HRM_MAX_WINDOW_SIZE - 1);
+							(group->history.size - 1);
 
 			heartbeats_w = heartbeats -
 				group->history.window[window_first].counter;
@@ -90,51 +493,362 @@ static enum hrtimer_restart __hrm_update_group_measures(struct hrtimer *timer)
 	}
 
 empty_buffer:
-	if (group->history.buffered < HRM_MAX_WINDOW_SIZE)
+	__hrm_end_measures_update(group, measures);
+
+	__hrm_update_slack(group, measures, goal);
+
+	if (group->history.buffered)
+		*notify |= __hrm_notify_group(group, measures, goal);
+	if (group->history.buffered < group->history.size)
 		group->history.buffered++;
 	group->history.window_cur =
-			(group->history.window_cur + 1) & (HRM_MAX_WINDOW_SIZE - 1);
+			(group->history.window_cur + 1) & (group->history.size - 1);
+
+#ifdef CONFIG_HRM_IDLE_INJECT
+	if (group->quiet > largest_ws)
+		__hrm_stop_inject(group);
+	else
+		__hrm_inject_idle(group, measures, goal);
+#endif
 
 	read_unlock_irqrestore(&group->members_lock, members_lock_flags);
 
-	return HRTIMER_NORESTART;
+	return group->quiet <= largest_ws;
+}
+
+static enum hrtimer_restart __hrm_engine_sample(struct hrtimer *timer)
+{
+	struct hrm_engine *engine;
+	struct hrm_group *group;
+	struct hrm_group *group_fallback;
+	enum hrtimer_restart restart = HRTIMER_NORESTART;
+	ktime_t now, next;
+	u64 period, slack = HRM_MAX_TIMER_PERIOD;
+	int notify = 0;
+
+	engine = container_of(timer, struct hrm_engine, timer);
+	now = hrtimer_cb_get_time(timer);
+	next.tv64 = KTIME_MAX;
+
+	spin_lock(&engine->lock);
+	list_for_each_entry_safe (group, group_fallback, &engine->groups, engine_link) {
+		period = __hrm_group_period(group);
+		if (group->next_sample.tv64 <= now.tv64) {
+			if (!__hrm_update_group_measures(group, &notify)) {
+				list_del_init(&group->engine_link);
+				group->suspended = 1;
+				continue;
+			}
+			group->next_sample = ktime_add_us(now, period);
+		}
+		if (group->next_sample.tv64 < next.tv64)
+			next = group->next_sample;
+		slack = min(slack, period);
+	}
+	if (!list_empty(&engine->groups)) {
+		hrtimer_set_expires_range_ns(timer, next,
+					NSEC_PER_USEC * slack / 10);
+		restart = HRTIMER_RESTART;
+	}
+	spin_unlock(&engine->lock);
+
+	if (notify)
+		wake_up_interruptible(&hrm_events_wait);
+
+	return restart;
+}
+
+/*
+ * May be called from the scheduler with its locks held: the engine timer is
+ * started without raising the softirq, the local cpu is the one to service
+ * it anyway.
+ */
+void __hrm_resume_group(struct hrm_group *group)
+{
+	struct hrm_engine *engine;
+	unsigned long flags;
+	u64 period;
+
+	if (!timespec_to_ns(&group->timestamp) || !xchg(&group->suspended, 0))
+		return;
+
+	period = __hrm_group_period(group);
+
+	local_irq_save(flags);
+	engine = &__get_cpu_var(hrm_engines);
+	spin_lock(&engine->lock);
+	group->engine = engine;
+	group->quiet = 0;
+	group->next_sample = ktime_add_us(hrtimer_cb_get_time(&engine->timer),
+								period);
+	list_add_tail(&group->engine_link, &engine->groups);
+	if (!hrtimer_active(&engine->timer) ||
+	    group->next_sample.tv64 < hrtimer_get_expires_tv64(&engine->timer))
+		__hrtimer_start_range_ns(&engine->timer, group->next_sample,
+				NSEC_PER_USEC * period / 10,
+				HRTIMER_MODE_ABS_PINNED, 0);
+	spin_unlock(&engine->lock);
+	local_irq_restore(flags);
+}
+
+static void __hrm_suspend_group(struct hrm_group *group)
+{
+	struct hrm_engine *engine = group->engine;
+	unsigned long flags;
+
+	if (engine == NULL)
+		return;
+
+	spin_lock_irqsave(&engine->lock, flags);
+	group->suspended = 1;
+	if (!list_empty(&group->engine_link))
+		list_del_init(&group->engine_link);
+	spin_unlock_irqrestore(&engine->lock, flags);
+
+#ifdef CONFIG_HRM_IDLE_INJECT
+	read_lock_irqsave(&group->members_lock, flags);
+	__hrm_stop_inject(group);
+	read_unlock_irqrestore(&group->members_lock, flags);
+#endif
+}
+
+static int __init hrm_engines_init(void)
+{
+	struct hrm_engine *engine;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		engine = &per_cpu(hrm_engines, cpu);
+		spin_lock_init(&engine->lock);
+		INIT_LIST_HEAD(&engine->groups);
+		hrtimer_init(&engine->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		engine->timer.function = __hrm_engine_sample;
+	}
+
+	return 0;
+}
+early_initcall(hrm_engines_init);
+
+void __hrm_fold_task(struct task_struct *task)
+{
+	struct hrm_producer *producer;
+	u64 counter;
+
+	list_for_each_entry (producer, &task->hrm_producers, task_link) {
+		counter = producer->counter->counter;
+		if (counter != producer->folded) {
+			__this_cpu_add(*producer->group->partial,
+						counter - producer->folded);
+			producer->folded = counter;
+			hrm_resume_group(producer->group);
+		}
+	}
+}
+
+static struct hrm_counter *__hrm_group_counter(struct hrm_group *group, int counter_index)
+{
+	struct page *page = group->counters_pages[counter_index / HRM_PAGE_GROUP_SIZE];
+
+	return (struct hrm_counter *) HRM_COUNTER_ADDR(page_address(page),
+					counter_index % HRM_PAGE_GROUP_SIZE);
+}
+
+/*
+ * Adds one zeroed page of counters to the group. The page array and the
+ * allocation bitmap are replaced rather than resized in place so that
+ * failures leave the group untouched; both are only used under
+ * hrm_groups_lock.
+ */
+static int __hrm_grow_group_counters(struct hrm_group *group, gfp_t gfp)
+{
+	int nr_pages = group->counters_nr_pages;
+	struct page *page;
+	struct page **pages;
+	unsigned long *allocation;
+	struct hrm_measures *measures;
+
+	if (nr_pages == HRM_GROUP_MAX_PAGES)
+		return -ENOSPC;
+
+	page = alloc_page(gfp | __GFP_ZERO);
+	if (page == NULL)
+		goto failure_alloc_page;
+	pages = kmalloc((nr_pages + 1) * sizeof(struct page *), gfp);
+	if (pages == NULL)
+		goto failure_kmalloc_pages;
+	allocation = kzalloc(BITS_TO_LONGS((nr_pages + 1) * HRM_PAGE_GROUP_SIZE) * sizeof(unsigned long), gfp);
+	if (allocation == NULL)
+		goto failure_kzalloc_allocation;
+
+	if (nr_pages) {
+		memcpy(pages, group->counters_pages, nr_pages * sizeof(struct page *));
+		bitmap_copy(allocation, group->counters_allocation, nr_pages * HRM_PAGE_GROUP_SIZE);
+	}
+	pages[nr_pages] = page;
+
+	kfree(group->counters_pages);
+	kfree(group->counters_allocation);
+	group->counters_pages = pages;
+	group->counters_allocation = allocation;
+	group->counters_nr_pages = nr_pages + 1;
+
+	measures = (struct hrm_measures *) HRM_MEASURES_ADDR(group->measures_goal.kernel_address);
+	measures->counters = group->counters_nr_pages * HRM_PAGE_GROUP_SIZE;
+
+	return 0;
+
+failure_kzalloc_allocation:
+	kfree(pages);
+failure_kmalloc_pages:
+	__free_page(page);
+failure_alloc_page:
+	return -ENOMEM;
+}
+
+/*
+ * Pages still mapped by some process are only released by the last unmap,
+ * since the fault handler takes a reference to each page it maps.
+ */
+static void __hrm_free_group_counters(struct hrm_group *group)
+{
+	int i;
+
+	for (i = 0; i < group->counters_nr_pages; i++)
+		__free_page(group->counters_pages[i]);
+	kfree(group->counters_pages);
+	kfree(group->counters_allocation);
+}
+
+static void __hrm_release_group(struct kref *ref)
+{
+	struct hrm_group *group = container_of(ref, struct hrm_group, ref);
+
+	__hrm_free_group_counters(group);
+	kfree(group->history.spare);
+	kfree_rcu(group, rcu);
+}
+
+/* Allocates the history ring the timer asked for, see __hrm_grow_history() */
+static void __hrm_grow_history_work(struct work_struct *work)
+{
+	struct hrm_group *group = container_of(work, struct hrm_group,
+						history.grow_work);
+	int size = ACCESS_ONCE(group->history.grow);
+	unsigned long members_lock_flags;
+	struct hrm_sample *window;
+
+	/* On failure the timer asks again in its next period */
+	window = kmalloc(size * sizeof(struct hrm_sample), GFP_KERNEL);
+	if (window != NULL) {
+		write_lock_irqsave(&group->members_lock, members_lock_flags);
+		if (group->history.spare_size < size) {
+			swap(group->history.spare, window);
+			group->history.spare_size = size;
+		}
+		write_unlock_irqrestore(&group->members_lock, members_lock_flags);
+		kfree(window);
+	}
+	kref_put(&group->ref, __hrm_release_group);
+}
+
+static void hrm_counters_open(struct vm_area_struct *vma)
+{
+	struct hrm_group *group = vma->vm_private_data;
+
+	kref_get(&group->ref);
 }
 
-static struct hrm_group *__hrm_create_group(int gid)
+static void hrm_counters_close(struct vm_area_struct *vma)
+{
+	struct hrm_group *group = vma->vm_private_data;
+
+	kref_put(&group->ref, __hrm_release_group);
+}
+
+static int hrm_counters_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct hrm_group *group = vma->vm_private_data;
+	struct page *page = NULL;
+
+	spin_lock(&hrm_groups_lock);
+	if (vmf->pgoff < group->counters_nr_pages) {
+		page = group->counters_pages[vmf->pgoff];
+		get_page(page);
+	}
+	spin_unlock(&hrm_groups_lock);
+
+	if (page == NULL)
+		return VM_FAULT_SIGBUS;
+	vmf->page = page;
+
+	return 0;
+}
+
+static const struct vm_operations_struct hrm_counters_vm_ops = {
+	.open = hrm_counters_open,
+	.close = hrm_counters_close,
+	.fault = hrm_counters_fault,
+};
+
+/*
+ * Pages are faulted in as the group grows, see hrm_counters_fault(). Only
+ * to be called once the mmap cannot fail anymore: the reference taken here
+ * is dropped by the close of the vma.
+ */
+void hrm_map_group_counters(struct vm_area_struct *vma,
+					struct hrm_group *group)
+{
+	vma->vm_flags |= VM_RESERVED | VM_DONTEXPAND;
+	vma->vm_private_data = group;
+	vma->vm_ops = &hrm_counters_vm_ops;
+	kref_get(&group->ref);
+}
+
+static struct hrm_group *__hrm_create_group(int gid, u64 __percpu *partial)
 {
 	struct hrm_group *group;
 
+	BUILD_BUG_ON(sizeof(struct hrm_measures) + sizeof(struct hrm_gaps) +
+					sizeof(struct hrm_goal) > PAGE_SIZE);
+
 	group = (struct hrm_group *) kzalloc(sizeof(struct hrm_group), GFP_KERNEL);
 	if (group == NULL) {
 		printk(KERN_ERR __FILE__ " @ %d kzalloc() failed\n", __LINE__);
-		group = ERR_PTR(-ENOMEM);
 		goto failure_kzalloc_group;
 	}
 
-	group->counters.kernel_address = __get_free_pages(GFP_KERNEL | __GFP_ZERO, HRM_GROUP_ORDER);
-	if (group->counters.kernel_address == 0) {
-		printk(KERN_ERR __FILE__ " @ %d __get_free_pages() failed\n", __LINE__);
-		group = ERR_PTR(-ENOMEM);
-		goto failure_get_free_pages;
-	}
-	group->counters.size = HRM_GROUP_SIZE * L1_CACHE_BYTES;
+	group->counters.size = HRM_GROUP_MAX_PAGES * PAGE_SIZE;
 	INIT_LIST_HEAD(&group->counters.maps);
 
 	group->measures_goal.kernel_address = get_zeroed_page(GFP_KERNEL);
 	if (group->measures_goal.kernel_address == 0) {
 		printk(KERN_ERR __FILE__ " @ %d get_zeroed_page() failed\n", __LINE__);
-		group = ERR_PTR(-ENOMEM);
 		goto failure_get_zeroed_page;
 	}
 	group->measures_goal.size = PAGE_SIZE;
 	INIT_LIST_HEAD(&group->measures_goal.maps);
 
-	group->gid = gid;
+	group->history.window = kzalloc(HRM_MIN_WINDOW_SIZE * sizeof(struct hrm_sample), GFP_KERNEL);
+	if (group->history.window == NULL) {
+		printk(KERN_ERR __FILE__ " @ %d kzalloc() failed\n", __LINE__);
+		goto failure_kzalloc_history;
+	}
+	group->history.size = HRM_MIN_WINDOW_SIZE;
+	INIT_WORK(&group->history.grow_work, __hrm_grow_history_work);
 
-	bitmap_zero(group->counters_allocation, HRM_GROUP_SIZE);
+	if (__hrm_grow_group_counters(group, GFP_KERNEL) < 0) {
+		printk(KERN_ERR __FILE__ " @ %d __hrm_grow_group_counters() failed\n", __LINE__);
+		goto failure_grow_group_counters;
+	}
 
-	hrtimer_init(&group->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
-	group->timer.function = __hrm_update_group_measures;
+	group->gid = gid;
+	group->partial = partial;
+	kref_init(&group->ref);
+	seqcount_init(&group->measures_seq);
+	group->slack = HRM_NO_SLACK;
+
+	group->suspended = 1;
+	INIT_LIST_HEAD(&group->engine_link);
 
 	INIT_LIST_HEAD(&group->producers);
 	INIT_LIST_HEAD(&group->consumers);
@@ -144,21 +858,24 @@ static struct hrm_group *__hrm_create_group(int gid)
 
 	return group;
 
+failure_grow_group_counters:
+	kfree(group->history.window);
+failure_kzalloc_history:
+	free_page(group->measures_goal.kernel_address);
 failure_get_zeroed_page:
-	free_pages(group->counters.kernel_address, HRM_GROUP_ORDER);
-failure_get_free_pages:
 	kfree(group);
 failure_kzalloc_group:
-	return group;
+	return ERR_PTR(-ENOMEM);
 }
 
 static int __hrm_destroy_group(struct hrm_group *group)
 {
-	hrtimer_cancel(&group->timer);
+	__hrm_suspend_group(group);
 
+	kfree(group->history.window);
+	free_percpu(group->partial);
 	free_page(group->measures_goal.kernel_address);
-	free_pages(group->counters.kernel_address, HRM_GROUP_ORDER);
-	kfree(group);
+	kref_put(&group->ref, __hrm_release_group);
 
 	return 0;
 }
@@ -192,11 +909,18 @@ static struct hrm_group *__hrm_find_group(int gid)
 static int __hrm_allocate_group_counter(struct hrm_group *group)
 {
 	int counter_index = 0;
+	int retval;
 
-	counter_index = bitmap_find_free_region(group->counters_allocation, HRM_GROUP_SIZE, 0);
+	counter_index = bitmap_find_free_region(group->counters_allocation,
+		group->counters_nr_pages * HRM_PAGE_GROUP_SIZE, 0);
 	if (counter_index < 0) {
-		printk(KERN_ERR __FILE__ " @ %d bitmap_find_free_region() failed\n", __LINE__);
-		return counter_index;
+		retval = __hrm_grow_group_counters(group, GFP_ATOMIC);
+		if (retval < 0) {
+			printk(KERN_ERR __FILE__ " @ %d __hrm_grow_group_counters() failed\n", __LINE__);
+			return retval;
+		}
+		counter_index = bitmap_find_free_region(group->counters_allocation,
+			group->counters_nr_pages * HRM_PAGE_GROUP_SIZE, 0);
 	}
 
 	return counter_index;
@@ -209,6 +933,17 @@ static int __hrm_release_group_counter(struct hrm_group *group, int counter_inde
 	return 0;
 }
 
+/* Points task->hrm_group to the group it joined last, see hrm_task_slack() */
+static void __hrm_link_task_group(struct task_struct *task)
+{
+	struct hrm_group *group = NULL;
+
+	if (!list_empty(&task->hrm_producers))
+		group = list_first_entry(&task->hrm_producers,
+				struct hrm_producer, task_link)->group;
+	rcu_assign_pointer(task->hrm_group, group);
+}
+
 struct hrm_producer *__hrm_find_producer_struct(struct task_struct *task, int gid)
 {
 	struct hrm_producer *producer;
@@ -230,6 +965,7 @@ int hrm_add_producer_task_to_group(struct task_struct *task, int gid)
 	unsigned long members_lock_flags;
 	int counter_index;
 	struct timespec current_time;
+	u64 __percpu *partial;
 
 	if (task == NULL) {
 		printk(KERN_ERR __FILE__ " @ %d task not valid\n", __LINE__);
@@ -247,16 +983,24 @@ int hrm_add_producer_task_to_group(struct task_struct *task, int gid)
 		return -ENOMEM;
 	}
 
+	partial = alloc_percpu(u64);
+	if (partial == NULL) {
+		printk(KERN_ERR __FILE__ " @ %d alloc_percpu() failed\n", __LINE__);
+		kfree(producer);
+		return -ENOMEM;
+	}
+
 	spin_lock(&hrm_groups_lock);
 
 	group = __hrm_find_group(gid);
 	if (group == NULL) {
-		group = __hrm_create_group(gid);
+		group = __hrm_create_group(gid, partial);
 		if (IS_ERR(group)) {
 			printk(KERN_ERR __FILE__ " @ %d __hrm_create_group() failed\n", __LINE__);
 			retval = PTR_ERR(group);
 			goto failure_create_group;
 		}
+		partial = NULL;
 	} else {
 		group_exists = 1;
 	}
@@ -270,9 +1014,10 @@ int hrm_add_producer_task_to_group(struct task_struct *task, int gid)
 
 	producer->task = task;
 	producer->counter_index = counter_index;
-	producer->counter = (struct hrm_counter *) HRM_COUNTER_ADDR(group->counters.kernel_address, counter_index);
+	producer->counter = __hrm_group_counter(group, counter_index);
 	producer->counter->tid = task->pid;
 	producer->counter->used = 1;
+	producer->folded = producer->counter->counter;
 	producer->measures = (struct hrm_measures *) HRM_MEASURES_ADDR(group->measures_goal.kernel_address);
 	producer->goal = (struct hrm_goal *) HRM_GOAL_ADDR(group->measures_goal.kernel_address);
 	producer->group = group;
@@ -282,6 +1027,11 @@ int hrm_add_producer_task_to_group(struct task_struct *task, int gid)
 	write_lock_irqsave(&group->members_lock, members_lock_flags);
 	list_add(&producer->task_link, &task->hrm_producers);
 	list_add(&producer->group_link, &group->producers);
+	__hrm_link_task_group(task);
+#ifdef CONFIG_HRM_IDLE_INJECT
+	if (group->inject_permille)
+		__hrm_set_throttle(producer, group->inject_permille);
+#endif
 	write_unlock_irqrestore(&group->members_lock, members_lock_flags);
 
 	if (!timespec_to_ns(&group->timestamp)) {
@@ -291,10 +1041,11 @@ int hrm_add_producer_task_to_group(struct task_struct *task, int gid)
 		group->timestamp = current_time;
 		group->history.window_cur = 1;
 		group->history.buffered = 1;
-		hrtimer_start(&group->timer, ktime_set(0, NSEC_PER_USEC * HRM_TIMER_PERIOD), HRTIMER_MODE_REL);
 	}
+	hrm_resume_group(group);
 
 	spin_unlock(&hrm_groups_lock);
+	free_percpu(partial);
 
 	return retval;
 
@@ -303,6 +1054,7 @@ failure_allocate_group_counter:
 		__hrm_destroy_group(group);
 failure_create_group:
 	spin_unlock(&hrm_groups_lock);
+	free_percpu(partial);
 	kfree(producer);
 
 	return retval;
@@ -326,13 +1078,18 @@ int hrm_delete_producer_task_from_group(struct task_struct *task, int gid)
 	}
 	group = producer->group;
 	producer->counter->used = 0;
-	group->history.history += producer->counter->counter;
-	__hrm_release_group_counter(group, producer->counter_index);
 
 	spin_lock(&hrm_groups_lock);
+	__hrm_release_group_counter(group, producer->counter_index);
 	write_lock_irqsave(&group->members_lock, members_lock_flags);
+	group->history.history += producer->counter->counter - producer->folded;
 	list_del(&producer->task_link);
 	list_del(&producer->group_link);
+	__hrm_link_task_group(task);
+#ifdef CONFIG_HRM_IDLE_INJECT
+	if (group->inject_permille)
+		__hrm_set_throttle(producer, 0);
+#endif
 	kfree(producer);
 	__hrm_put_group_memory_map(task, &group->counters);
 	__hrm_put_group_memory_map(task, &group->measures_goal);
@@ -368,11 +1125,16 @@ int hrm_delete_producer_task_from_all_groups(struct task_struct *task)
 	spin_lock(&hrm_groups_lock);
 	list_for_each_entry_safe (producer, producer_fallback, &task->hrm_producers, task_link) {
 		group = producer->group;
-		group->history.history += producer->counter->counter;
 		__hrm_release_group_counter(group, producer->counter_index);
 		write_lock_irqsave(&group->members_lock, members_lock_flags);
+		group->history.history += producer->counter->counter - producer->folded;
 		list_del(&producer->task_link);
 		list_del(&producer->group_link);
+		__hrm_link_task_group(task);
+#ifdef CONFIG_HRM_IDLE_INJECT
+		if (group->inject_permille)
+			__hrm_set_throttle(producer, 0);
+#endif
 		kfree(producer);
 		__hrm_put_group_memory_map(task, &group->counters);
 		__hrm_put_group_memory_map(task, &group->measures_goal);
@@ -428,6 +1190,7 @@ int hrm_add_consumer_task_to_group(struct task_struct *task, int gid)
 	struct hrm_group *group;
 	int group_exists = 0;
 	unsigned long members_lock_flags;
+	u64 __percpu *partial;
 
 	if (task == NULL) {
 		printk(KERN_ERR __FILE__ " @ %d task not valid\n", __LINE__);
@@ -445,21 +1208,30 @@ int hrm_add_consumer_task_to_group(struct task_struct *task, int gid)
 		return -ENOMEM;
 	}
 
+	partial = alloc_percpu(u64);
+	if (partial == NULL) {
+		printk(KERN_ERR __FILE__ " @ %d alloc_percpu() failed\n", __LINE__);
+		kfree(consumer);
+		return -ENOMEM;
+	}
+
 	spin_lock(&hrm_groups_lock);
 
 	group = __hrm_find_group(gid);
 	if (group == NULL) {
-		group = __hrm_create_group(gid);
+		group = __hrm_create_group(gid, partial);
 		if (IS_ERR(group)) {
 			printk(KERN_ERR __FILE__ " @ %d __hrm_create_group() failed\n", __LINE__);
 			retval = PTR_ERR(group);
 			goto failure_create_group;
 		}
+		partial = NULL;
 	} else {
 		group_exists = 1;
 	}
 
 	consumer->group = group;
+	consumer->events_seen = group->events;
 	INIT_LIST_HEAD(&consumer->task_link);
 	INIT_LIST_HEAD(&consumer->group_link);
 
@@ -472,11 +1244,13 @@ int hrm_add_consumer_task_to_group(struct task_struct *task, int gid)
 		__hrm_add_group(group);
 
 	spin_unlock(&hrm_groups_lock);
+	free_percpu(partial);
 
 	return retval;
 
 failure_create_group:
 	spin_unlock(&hrm_groups_lock);
+	free_percpu(partial);
 	kfree(consumer);
 
 	return retval;
@@ -637,22 +1411,13 @@ unsigned long __hrm_find_group_memory_map(struct task_struct *task, struct hrm_m
 	return 0;
 }
 
-static inline u64 __hrm_compute_hr(u64 count, u64 time)
-{
-	u64 scaled_time, scaled_count;
-
-	scaled_count = count * USEC_PER_SEC;
-	scaled_time = div64_u64(MSEC_PER_SEC, HRM_MEASURE_SCALE);
-	scaled_time = div64_u64(time, scaled_time);
-
-	return div64_u64(scaled_count, scaled_time);
-}
-
 u64
 hrm_seek_heart_rate(const struct hrm_group* group, size_t window_size, int *key)
 {
 	struct hrm_goal *goal = NULL;
 	struct hrm_measures *measures;
+	struct hrm_measure measure;
+	unsigned seq;
 	u64 hr = 0;
 	int i;
 
@@ -664,6 +1429,7 @@ hrm_seek_heart_rate(const struct hrm_group* group, size_t window_size, int *key)
 		*key = -EINVAL;
 		goto exit;
 	}
+	hrm_resume_group((struct hrm_group *) group);
 
 	goal = (struct hrm_goal *)
 			HRM_GOAL_ADDR(group->measures_goal.kernel_address);
@@ -672,25 +1438,28 @@ hrm_seek_heart_rate(const struct hrm_group* group, size_t window_size, int *key)
 
 	if (window_size == 0) {
 		*key = 0;
-		while(__sync_lock_test_and_set(&goal->goal_lock, 1));
-		if (measures->global.time)
-			hr = __hrm_compute_hr(measures->global.count,
-							measures->global.time);
-		__sync_lock_release(&goal->goal_lock);
+		do {
+			seq = read_seqcount_begin(&group->measures_seq);
+			measure = measures->global;
+		} while (read_seqcount_retry(&group->measures_seq, seq));
+		if (measure.time)
+			hr = __hrm_compute_hr(measure.count, measure.time);
 
 		goto exit;
 	}
 
-	while(__sync_lock_test_and_set(&goal->goal_lock, 1));
 	for (i = 0; i < HRM_MAX_WINDOWS; i++)
-		if (goal->window_size[i] == window_size &&
-						measures->window[i].time) {
+		if (ACCESS_ONCE(goal->window_size[i]) == window_size) {
+			do {
+				seq = read_seqcount_begin(&group->measures_seq);
+				measure = measures->window[i];
+			} while (read_seqcount_retry(&group->measures_seq, seq));
+			if (!measure.time)
+				continue;
 			*key = i + 1;
-			hr = __hrm_compute_hr(measures->window[i].count,
-						measures->window[i].time);
+			hr = __hrm_compute_hr(measure.count, measure.time);
 			break;
 		}
-	__sync_lock_release(&goal->goal_lock);
 
 	if (i == HRM_MAX_WINDOWS)
 		*key = -EINVAL;
@@ -704,6 +1473,8 @@ hrm_get_heart_rate(const struct hrm_group* group, size_t *window_size, int key)
 {
 	struct hrm_goal *goal = NULL;
 	struct hrm_measures *measures;
+	struct hrm_measure measure;
+	unsigned seq;
 	u64 hr = 0;
 
 	if (!group) {
@@ -714,6 +1485,7 @@ hrm_get_heart_rate(const struct hrm_group* group, size_t *window_size, int key)
 		*window_size = HRM_MAX_WINDOW_SIZE;
 		goto exit;
 	}
+	hrm_resume_group((struct hrm_group *) group);
 
 	goal = (struct hrm_goal *)
 			HRM_GOAL_ADDR(group->measures_goal.kernel_address);
@@ -722,23 +1494,25 @@ hrm_get_heart_rate(const struct hrm_group* group, size_t *window_size, int key)
 
 	if (key == 0) {
 		*window_size = 0;
-		while(__sync_lock_test_and_set(&goal->goal_lock, 1));
-		if (measures->global.time)
-			hr = __hrm_compute_hr(measures->global.count,
-							measures->global.time);
-		__sync_lock_release(&goal->goal_lock);
+		do {
+			seq = read_seqcount_begin(&group->measures_seq);
+			measure = measures->global;
+		} while (read_seqcount_retry(&group->measures_seq, seq));
+		if (measure.time)
+			hr = __hrm_compute_hr(measure.count, measure.time);
 
 		goto exit;
 	}
 
-	while(__sync_lock_test_and_set(&goal->goal_lock, 1));
-	*window_size = goal->window_size[key - 1];
-	if (*window_size != 0 && measures->window[key - 1].time)
-		hr = __hrm_compute_hr(measures->window[key - 1].count,
-					measures->window[key - 1].time);
+	*window_size = ACCESS_ONCE(goal->window_size[key - 1]);
+	do {
+		seq = read_seqcount_begin(&group->measures_seq);
+		measure = measures->window[key - 1];
+	} while (read_seqcount_retry(&group->measures_seq, seq));
+	if (*window_size != 0 && measure.time)
+		hr = __hrm_compute_hr(measure.count, measure.time);
 	else
 		*window_size = HRM_MAX_WINDOW_SIZE;
-	__sync_lock_release(&goal->goal_lock);
 
 exit:
 	return hr;
@@ -757,10 +1531,8 @@ u64 hrm_get_min_heart_rate(const struct hrm_group* group, size_t *window_size)
 
 	goal = (struct hrm_goal *)
 			HRM_GOAL_ADDR(group->measures_goal.kernel_address);
-	while(__sync_lock_test_and_set(&goal->goal_lock, 1));
-	*window_size = goal->scope;
-	hr = goal->min_heart_rate;
-	__sync_lock_release(&goal->goal_lock);
+	*window_size = ACCESS_ONCE(goal->scope);
+	hr = ACCESS_ONCE(goal->min_heart_rate);
 
 exit:
 	return hr;
@@ -778,10 +1550,8 @@ u64 hrm_get_max_heart_rate(const struct hrm_group* group, size_t *window_size)
 
 	goal = (struct hrm_goal *)
 			HRM_GOAL_ADDR(group->measures_goal.kernel_address);
-	while(__sync_lock_test_and_set(&goal->goal_lock, 1));
-	*window_size = goal->scope;
-	hr = goal->max_heart_rate;
-	__sync_lock_release(&goal->goal_lock);
+	*window_size = ACCESS_ONCE(goal->scope);
+	hr = ACCESS_ONCE(goal->max_heart_rate);
 
 exit:
 	return hr;
@@ -4249,6 +4249,9 @@ void scheduler_tick(void)
 	update_cpu_load_active(rq);
 	curr->sched_class->task_tick(rq, curr, 0);
 	raw_spin_unlock(&rq->lock);
+#ifdef CONFIG_HRM
+	hrm_fold_task(curr);
+#endif
 
 	perf_event_task_tick();
 
@@ -4415,6 +4418,9 @@ need_resched:
 		hrtick_clear(rq);
 
 	raw_spin_lock_irq(&rq->lock);
+#ifdef CONFIG_HRM
+	hrm_fold_task(prev);
+#endif
 
 	switch_count = &prev->nivcsw;
 	if (prev->state && !(preempt_count() & PREEMPT_ACTIVE)) {
@@ -78,6 +78,9 @@
 #include <linux/module.h>
 #include <linux/string.h>
 #include <linux/list.h>
+#include <linux/cpuidle.h>
+#include <linux/thermal.h>
+#include <linux/ratelimit.h>
 
 #include <asm/uaccess.h>
 #include <asm/tlb.h>
@@ -139,240 +142,9 @@
 #define NS_TO_US(TIME)		((TIME) >> 10)
 
 #define RESCHED_US	(100) /* Reschedule if less than this many μs left */
+#define IDLE_INJECT_HIST_BUCKETS	(16) /* log2 μs buckets of idle overshoot */
 #define MOD_INC_USE_COUNT
 #define MOD_DEC_USE_COUNT
-/*
- * Starting from here you can find the variables and costants of BFSIDLEINJ : system
- */
-#define INJECTION_IDLE_CYCLE_EACH_TIME 2000 /*Default value for the global_injection */
-#define INJECTION_IDLE_CYCLE_PROC      5 /*Minimun value of max_load and global_rate to avoid deadlock of the system*/
-int is_init = 1; /*Flag to know if we are at init or not */
-int idle_cycles_offset = 0; /*Variable used as bound of global_rate. its value changes at runtime*/
-
-/*This are the data and the functions to manage the procfs files related to 
- * parameters of the idle injection*/
-struct pid_list{
-	struct  list_head list; /*pointer to the list*/
-	int pid; /*pid or tid to check and limit */
-	int max_load; /*every max_load we have an injection of idle instead my process or thread*/
-	int times; /*count how many times process with that pid is scheduled*/
-	char type; /*flag that says if check the pid or tid of the process scheduled*/
-};
-
-struct sched_parameters{
-	int global_rate; /*runtime value of idle injection at global level*/
-	struct pid_list *pidList; /*head of the pid and tid list */	 
-};
- 
-static struct sched_parameters param; /* global variable to manage for our goal*/
-static spinlock_t lst_write_lock; /* synchronization variable*/
-static spinlock_t global_write_lock; /* synchronization variable */
-
-/*Function that allows people from userspace to read data
- * from the kernel (read the global rate of injection)*/
-static int proc_read_idleGlobal(char *page, char **start,
-			off_t off, int count, 
-			int *eof, void *data){	
-			
-	int len;
-
-	spin_lock(&global_write_lock);
-	len = sprintf(page, "Global_rate = %d, rate = %d\n", param.global_rate,idle_cycles_offset);
-	spin_unlock(&global_write_lock);
-	return len;
-}
-
-/*Function that allows people from userspace to read data 
- * from the kernel (read the set of pids to restrict)*/
-static int proc_read_idlePid(char *page, char **start,
-			off_t off, int count,
-			int *eof, void *data){
-	int len=0;
-	
-	len += sprintf(page,"%s\n\n", "Format Type: pid,max_load,times,type");
-	if(!list_empty(&param.pidList->list)){
-		struct pid_list *f;
-		spin_lock(&lst_write_lock);
-		list_for_each_entry_rcu(f, &param.pidList->list,list){
-			len += sprintf(page+len, "%d,%d,%d,%c\n",f->pid,f->max_load,f->times,f->type);
-		}
-		spin_unlock(&lst_write_lock);
-	}else{
-		len += sprintf(page+len, "%s\n", "No processes observed");
-	}
-	return len;
-}
-
-/*Function that allows people from userspace to write data
- * to the kernel (write the global rate of injection)*/
-static int proc_write_idleGlobal(struct file *file,
-			const char *buffer,
-			unsigned long count,
-			void *data){
-	char *buffer_ker = kmalloc(sizeof(char)*count, GFP_ATOMIC);
-	memset(buffer_ker,0, sizeof(char) * count);
-	if(copy_from_user(buffer_ker,buffer,count)!=0){
-		printk("BFSIDLEINJ: copy_from_user() failed\n");
-		return -EFAULT;
-	}
-	spin_lock(&global_write_lock);
-	if((int)simple_strtol(buffer_ker, NULL, 10) >= 2){
-		param.global_rate = (int) simple_strtol(buffer_ker, NULL, 10);
-		idle_cycles_offset = 0;
-	}	
-	spin_unlock(&global_write_lock);
-	printk("BFSIDLEINJ: idleGlobal has been written to %d\n",param.global_rate);
-	kfree(buffer_ker);
-	return count;
-}
-
-/*Function that allows people from userspace to write data
- * to the kernel (write the set of pids to restrict) */
-static int proc_write_idlePid(struct file *file,
-			const char *buffer,
-			unsigned long count,
-			void *data){
-	struct pid_list *pid_new, *f;
-	char *buffer_ker, *buffer_ker_copy;
-	char *temp_pid;
-	char *temp_load;
-	char *temp_type;
-	f=NULL;
-	do{
-		pid_new = kmalloc(sizeof(struct pid_list), GFP_ATOMIC);
-		if (pid_new == NULL) printk("BFSIDLEINJ: pid_new->poiter creation failed\n");
-	}while(pid_new == NULL);
-	do{
-		buffer_ker = kmalloc(sizeof(char)*count, GFP_ATOMIC);
-		if(buffer_ker == NULL) printk("BFSIDLEINJ: buffer_ker->pointer creation failed\n");
-	}while(buffer_ker==NULL);
-	if(copy_from_user(buffer_ker, buffer, count) !=0){
-		printk("BFSIDLEINJ: copy_from_user() failed\n");
-		return -EFAULT;
-	}
-	buffer_ker_copy =  buffer_ker;
-	temp_pid = strsep(&buffer_ker,",");
-	temp_load = strsep(&buffer_ker,",");
-	temp_type = strsep(&buffer_ker,",");
-	pid_new->pid = (int) simple_strtol(temp_pid,NULL,10);
-	pid_new->max_load = (int) simple_strtol(temp_load, NULL,10);
-        pid_new->times = 0;
-	if(temp_type != NULL)
-		pid_new->type = *temp_type;
-	else
-		pid_new->type = 't';
-	if(pid_new->max_load < INJECTION_IDLE_CYCLE_PROC){
-		printk("BFSIDLEINJ: Max_load inserted is not valid!!! it must be >= %d\n",INJECTION_IDLE_CYCLE_PROC);	
-		kfree(pid_new);
-		goto free;
-	}
-	
-		if((pid_new->type != 't') && (pid_new->type != 'p')){
-			printk("BFSIDLEINJ: The type inserted is not valid!!! it must be either 't' or 'p'\n");
-			kfree(pid_new);
-			goto free;
-		}
-
-	if(list_empty(&param.pidList->list)){	
-		printk("BFSIDLEINJ: Case empty list\n");
-		if(pid_new->pid > 0 ){
-			spin_lock(&lst_write_lock);
-			if(pid_new->type == 'p')
-				list_add_tail_rcu(&pid_new->list, &param.pidList->list);
-			else
-				list_add_rcu(&pid_new->list, &param.pidList->list);
-			spin_unlock(&lst_write_lock);
-			printk("BFSIDLEINJ: First Element Added\n");
-			goto free;
-		}
-		else{ 
-			printk("BFSIDLEINJ: Negative pid doesn't mean anything if there's no element in the list\n");
-			kfree(pid_new);
-			goto free;
-		}
-	}
-	else {
-		printk("BFSIDLEINJ: Case one or more elements in the list\n");
-		list_for_each_entry_rcu(f, &param.pidList->list,list){
-			if(f->pid == pid_new->pid){
-				spin_lock(&lst_write_lock);
-				list_replace_rcu(&f->list, &pid_new->list);
-				spin_unlock(&lst_write_lock);
-				printk("BFSIDLEINJ: Max_load updated to %d of pid = %d\n", pid_new->max_load,pid_new->pid);
-				kfree(f);
-				goto free;
-			}
-			if(f->pid == (-1* pid_new->pid)){
-				spin_lock(&lst_write_lock);
-				list_del_rcu(&f->list);
-				spin_unlock(&lst_write_lock);
-				kfree(f);
-				printk("BFSIDLEINJ: Element removed\n");
-				goto free;
-			}
-		}
-	}
-	if(pid_new->pid >0){
-		spin_lock(&lst_write_lock);
-		if(pid_new->type == 'p')
-		 	list_add_tail_rcu(&pid_new->list, &param.pidList->list);
-		else
-			list_add_rcu(&pid_new->list, &param.pidList->list);
-		spin_unlock(&lst_write_lock);
-		printk("BFSIDLEINJ: Added one element to the list\n");
-		goto free;
-	}
-	else{
-		kfree(pid_new);
-	}
-
-free:	kfree(buffer_ker_copy);
-
-	return count;
-}
-
-static struct proc_dir_entry *schedidle_file_global, *schedidle_file_pid, *schedidle_dir;
-
-/*Function that create the proc file and initialiaze all the variables in  a consistent way
- */
-static void set_everything_idlepar(void)
-{
-	param.global_rate = INJECTION_IDLE_CYCLE_EACH_TIME;
-	param.pidList = kmalloc(sizeof(struct pid_list), GFP_ATOMIC);
-	INIT_LIST_HEAD(&param.pidList->list);
-	//creation of the directory where put the files
-	schedidle_dir = proc_mkdir("schedidle",NULL);
-	if(schedidle_dir == NULL){
-		printk("BFSIDLEINJ: /proc/schedidle hasn't been created\n");
-		goto end;
-	}
-	schedidle_dir->uid = 0;
-	schedidle_dir->gid = 0;
-	//creation of the global param file inside /proc/schedidle
-	schedidle_file_global = create_proc_entry("sched_global", 0644, schedidle_dir);
-	if(schedidle_file_global == NULL){
-		printk("BFSIDLEINJ: /proc/schedidle/sched_global file hasn't been created\n");
-		goto end;
-	}
-	schedidle_file_global->uid = 0;
-	schedidle_file_global->gid = 0;
-	schedidle_file_global->data = &param;
-	schedidle_file_global->read_proc = proc_read_idleGlobal;
-	schedidle_file_global->write_proc = proc_write_idleGlobal;
-	//creation of the Pid file inside /proc/schedidle
-	schedidle_file_pid = create_proc_entry("sched_pid", 0644, schedidle_dir);
-	if(schedidle_file_pid == NULL){
-		printk("BFSIDLEINJ: /proc/schedidle/sched_pid file hasn't been created\n");
-		goto end;
-	}
-	schedidle_file_pid->uid = 0;
-	schedidle_file_pid->gid = 0;
-	schedidle_file_pid->data = param.pidList;
-	schedidle_file_pid->read_proc = proc_read_idlePid;
-	schedidle_file_pid->write_proc = proc_write_idlePid;
-  end:  printk("BFSIDLEINJ: Procfs Schedidle initialization Completed\n");
-}
-/*End of the definition procfs parameters managing */
 
 /*
  * This is the time all tasks within the same priority round robin.
@@ -388,6 +160,18 @@ int rr_interval __read_mostly = 6;
  */
 int sched_iso_cpu __read_mostly = 70;
 
+#ifdef CONFIG_HRM
+/*
+ * sched_hrm_boost - sysctl which scales the deadline offset of HRM producers
+ * by the goal slack of their group, in percent: a group at half its minimum
+ * heart rate gets deadlines boost/2 percent earlier, one at twice its maximum
+ * heart rate or more boost percent later, one within its goal is left alone.
+ * 0 disables it, the maximum of 90 keeps every offset at least a tenth of
+ * the normal one.
+ */
+int sched_hrm_boost __read_mostly;
+#endif
+
 /*
  * The relative length of deadline for each priority(nice) level.
  */
@@ -402,6 +186,17 @@ static inline int timeslice(void)
 	return MS_TO_US(rr_interval);
 }
 
+/*
+ * The queued tasks, one list per priority with a bitmap of the non empty
+ * ones. The tasks of the non rt priorities are also sorted by deadline in a
+ * tree. Always protected by the grq lock.
+ */
+struct edf_queue {
+	struct list_head queue[PRIO_LIMIT];
+	struct rb_root deadlines[PRIO_LIMIT - MAX_RT_PRIO];
+	DECLARE_BITMAP(prio_bitmap, PRIO_LIMIT + 1);
+};
+
 /*
  * The global runqueue data that all CPUs work off. Data is protected either
  * by the global grq lock, or the discrete lock that precedes the data in this
@@ -412,8 +207,7 @@ struct global_rq {
 	unsigned long nr_running;
 	unsigned long nr_uninterruptible;
 	unsigned long long nr_switches;
-	struct list_head queue[PRIO_LIMIT];
-	DECLARE_BITMAP(prio_bitmap, PRIO_LIMIT + 1);
+	struct edf_queue edf; /* Queue shared by all CPUs */
 #ifdef CONFIG_SMP
 	unsigned long qnr; /* queued not running */
 	cpumask_t cpu_idle_map;
@@ -426,6 +220,8 @@ struct global_rq {
 	raw_spinlock_t iso_lock;
 	int iso_ticks;
 	int iso_refractory;
+
+	u64 throttle_seq; /* Counts the picks, see earliest_deadline_task() */
 };
 
 #ifdef CONFIG_SMP
@@ -513,6 +309,7 @@ struct rq {
 	/* See if all cache siblings are idle */
 	cpumask_t cache_siblings;
 #endif
+	struct edf_queue pinned; /* Tasks allowed on this cpu only */
 	u64 last_niffy; /* Last time this RQ updated grq.niffies */
 #endif
 #ifdef CONFIG_IRQ_TIME_ACCOUNTING
@@ -529,6 +326,25 @@ struct rq {
 	u64 clock_task;
 	bool dither;
 
+	/* BFSIDLEINJ per-CPU state, only modified by the local CPU */
+	int idle_inject_rate; /* inject idle once every rate schedule(), 0 = off */
+	int idle_inject_offset; /* schedule() calls since the last idle */
+	unsigned long idle_inject_count; /* number of injected idle periods */
+	/* Time based injection: idle_inject_us of idle every period_ms */
+	unsigned int idle_inject_us;
+	unsigned int idle_inject_period_ms;
+	char idle_inject_sync; /* 'n'one, or aligned with 's'mt, 'c'ache, 'p'ackage */
+	int idle_inject_min_state; /* shallowest cpuidle state for injected idle */
+	unsigned int idle_inject_len_us; /* Length of a rate triggered window */
+	bool idle_inject_forced; /* Inside an injected idle window */
+	struct hrtimer idle_inject_timer; /* Opens the timed idle window */
+	struct hrtimer idle_inject_end_timer; /* Closes any idle window */
+	/* Requested against actual length of the injected windows */
+	unsigned int idle_inject_req_us; /* Length of the open window, 0 = none */
+	u64 idle_inject_stamp; /* rq->clock when the window was opened */
+	u64 idle_inject_req_ns, idle_inject_act_ns;
+	unsigned long idle_inject_hist[IDLE_INJECT_HIST_BUCKETS];
+
 #ifdef CONFIG_SCHEDSTATS
 
 	/* latency stats */
@@ -667,9 +483,1078 @@ static inline void update_clocks(struct rq *rq)
 	grq.niffies += ndiff;
 }
 #endif
-#define raw_rq()	(&__raw_get_cpu_var(runqueues))
+#define raw_rq()	(&__raw_get_cpu_var(runqueues))
+
+#include "sched_stats.h"
+
+/*
+ * Starting from here you can find the variables and costants of BFSIDLEINJ : system
+ */
+#define INJECTION_IDLE_CYCLE_EACH_TIME 2000 /*Default value for the global_injection */
+#define INJECTION_IDLE_CYCLE_PROC      5 /*Minimun value of max_load and global_rate to avoid deadlock of the system*/
+#define INJECTION_IDLE_CYCLE_MIN       2 /*Minimum value of a per-CPU rate, 0 switches the injection off*/
+#define INJECTION_IDLE_LENGTH_US       (USEC_PER_SEC / HZ) /*Default length of an idle window injected by the rate*/
+#define INJECTION_THERMAL_PERIOD_MS    10 /*Period of the duty cycle set by the thermal controller*/
+#define INJECTION_THERMAL_MAX_PERMILLE 800 /*Largest share of that period the thermal controller idles*/
+#define INJECTION_COOLING_STATES       10 /*Levels of the cooling devices, the last one idles the largest share*/
+
+/*This are the data and the functions to manage the procfs files related to 
+ * parameters of the idle injection*/
+struct sched_parameters{
+	int global_rate; /*default rate of idle injection, applied to every cpu when written*/
+};
+
+static struct sched_parameters param = {
+	.global_rate = INJECTION_IDLE_CYCLE_EACH_TIME,
+}; /* global variable to manage for our goal*/
+static DEFINE_SPINLOCK(global_write_lock); /* synchronization variable */
+
+/*
+ * The throttled threads and processes keep their budget in their own
+ * task_struct and signal_struct, so the check in earliest_deadline_task()
+ * is a dereference of the task it found, under the grq.lock it already
+ * holds. /proc/schedidle/sched_pid writes max_load without that lock: a
+ * racing pick at worst counts once against the old budget. Returns the mode
+ * of the throttle that ran out, 0 otherwise.
+ */
+static inline char throttle_due(struct sched_throttle *throttle)
+{
+	int max_load = ACCESS_ONCE(throttle->max_load);
+	int hrm_max_load = ACCESS_ONCE(throttle->hrm_max_load);
+	char mode = throttle->mode;
+
+	if (hrm_max_load && (!max_load || hrm_max_load <= max_load)) {
+		max_load = hrm_max_load;
+		mode = 'i';
+	}
+	if (likely(!max_load))
+		return 0;
+	if (++throttle->times < max_load)
+		return 0;
+	throttle->times = 0;
+	return mode;
+}
+
+/*
+ * The injection counter lives in struct rq so that every CPU counts its own
+ * schedule() calls without touching a shared cache line. A rate of 0 turns
+ * the injection off on that CPU.
+ */
+static inline bool idle_inject_due(struct rq *rq)
+{
+	int rate = ACCESS_ONCE(rq->idle_inject_rate);
+
+	if (!rate || ++rq->idle_inject_offset < rate)
+		return false;
+	return true;
+}
+
+/*
+ * Every injected idle period is a window with an explicit, absolute end: the
+ * end timer reschedules the CPU on time even with the tick stopped, whatever
+ * opened the window. Called with interrupts disabled on the local CPU,
+ * possibly under grq.lock, so the hrtimer code must not raise its softirq
+ * here as waking ksoftirqd would need grq.lock again.
+ */
+static void idle_inject_open(struct rq *rq, unsigned int idle_us, ktime_t end)
+{
+	rq->idle_inject_forced = true;
+	rq->idle_inject_count++;
+	rq->idle_inject_req_us = idle_us;
+	rq->idle_inject_stamp = sched_clock_cpu(cpu_of(rq));
+	__hrtimer_start_range_ns(&rq->idle_inject_end_timer, end, 0,
+				 HRTIMER_MODE_ABS_PINNED, 0);
+}
+
+/* Opens a window of idle_us starting now */
+static void idle_inject_open_now(struct rq *rq, unsigned int idle_us)
+{
+	ktime_t now = hrtimer_cb_get_time(&rq->idle_inject_end_timer);
+
+	idle_inject_open(rq, idle_us, ktime_add_us(now, idle_us));
+}
+
+/*
+ * Called from schedule() once the window has been closed. The histogram
+ * records by how much the actual idle period overran the requested one.
+ */
+static void idle_inject_account(struct rq *rq)
+{
+	u64 requested = (u64)rq->idle_inject_req_us * NSEC_PER_USEC;
+	u64 actual = rq->clock - rq->idle_inject_stamp;
+	unsigned long over_us = 0;
+	int bucket;
+
+	if (actual > requested)
+		over_us = NS_TO_US(actual - requested);
+	bucket = min_t(int, fls_long(over_us), IDLE_INJECT_HIST_BUCKETS - 1);
+	rq->idle_inject_hist[bucket]++;
+	rq->idle_inject_req_ns += requested;
+	rq->idle_inject_act_ns += actual;
+	rq->idle_inject_req_us = 0;
+}
+
+static void set_idle_inject_rate(int cpu, int rate)
+{
+	struct rq *rq = cpu_rq(cpu);
+
+	rq->idle_inject_rate = rate;
+	rq->idle_inject_offset = 0;
+}
+
+static void set_idle_inject_length(int cpu, unsigned int len_us)
+{
+	cpu_rq(cpu)->idle_inject_len_us = len_us;
+}
+
+/*
+ * Time based injection. Counting schedule() calls makes the amount of idle
+ * depend on how often the workload context switches, so every CPU can also
+ * run a duty cycle of idle_inject_us of idle every idle_inject_period_ms.
+ * Both timers are pinned to their CPU and only ever touch the local rq: the
+ * first one opens the idle window and forces schedule() to pick rq->idle,
+ * the second one closes it.
+ */
+static enum hrtimer_restart idle_inject_start(struct hrtimer *timer)
+{
+	struct rq *rq = container_of(timer, struct rq, idle_inject_timer);
+	unsigned int period_ms = rq->idle_inject_period_ms;
+	unsigned int idle_us = rq->idle_inject_us;
+
+	if (unlikely(!period_ms || !idle_us ||
+	    cpu_of(rq) != smp_processor_id()))
+		return HRTIMER_NORESTART;
+
+	/*
+	 * End the window relative to when it was due rather than to now, so
+	 * that the CPUs synchronized on the same grid also leave it together.
+	 */
+	idle_inject_open(rq, idle_us,
+			 ktime_add_us(hrtimer_get_expires(timer), idle_us));
+	set_tsk_need_resched(current);
+
+	hrtimer_forward_now(timer, ns_to_ktime((u64)period_ms * NSEC_PER_MSEC));
+	return HRTIMER_RESTART;
+}
+
+static enum hrtimer_restart idle_inject_end(struct hrtimer *timer)
+{
+	struct rq *rq = container_of(timer, struct rq, idle_inject_end_timer);
+
+	rq->idle_inject_forced = false;
+	if (likely(cpu_of(rq) == smp_processor_id()))
+		set_tsk_need_resched(current);
+	return HRTIMER_NORESTART;
+}
+
+/*
+ * Called on the target CPU so that the timers end up pinned to it.
+ *
+ * The package only reaches its deep C-states when all of its cores are idle
+ * at the same time, which never happens by chance when each CPU injects on
+ * its own schedule. Synchronized CPUs therefore start on a grid of
+ * CLOCK_MONOTONIC multiples of their period, which hrtimer_forward_now()
+ * preserves: every CPU sharing the period opens and closes its windows
+ * together, much like acpi_pad idles all its CPUs in the same mwait round.
+ */
+static void idle_inject_arm(void *data)
+{
+	struct rq *rq = data;
+	u64 period_ns, now;
+
+	hrtimer_cancel(&rq->idle_inject_timer);
+	hrtimer_cancel(&rq->idle_inject_end_timer);
+	if (rq->idle_inject_forced) {
+		rq->idle_inject_forced = false;
+		set_tsk_need_resched(current);
+	}
+	if (!rq->idle_inject_us || !rq->idle_inject_period_ms)
+		return;
+
+	period_ns = (u64)rq->idle_inject_period_ms * NSEC_PER_MSEC;
+	if (rq->idle_inject_sync == 'n') {
+		hrtimer_start(&rq->idle_inject_timer, ns_to_ktime(period_ns),
+			      HRTIMER_MODE_REL_PINNED);
+		return;
+	}
+	now = ktime_to_ns(hrtimer_cb_get_time(&rq->idle_inject_timer));
+	hrtimer_start(&rq->idle_inject_timer,
+		      ns_to_ktime((div64_u64(now, period_ns) + 1) * period_ns),
+		      HRTIMER_MODE_ABS_PINNED);
+}
+
+static void set_idle_inject_duty(int cpu, unsigned int idle_us,
+				 unsigned int period_ms, char sync)
+{
+	struct rq *rq = cpu_rq(cpu);
+
+	rq->idle_inject_us = idle_us;
+	rq->idle_inject_period_ms = period_ms;
+	rq->idle_inject_sync = sync;
+	if (cpu_online(cpu))
+		smp_call_function_single(cpu, idle_inject_arm, rq, 1);
+}
+
+/* The CPUs that inject together with cpu in the given synchronized mode */
+static const struct cpumask *idle_inject_sync_mask(int cpu, char sync)
+{
+	switch (sync) {
+	case 's':
+		return topology_thread_cpumask(cpu);
+#ifdef CONFIG_SCHED_MC
+	case 'c':
+		return cpu_coregroup_mask(cpu);
+#endif
+	case 'p':
+		return topology_core_cpumask(cpu);
+	}
+	return cpumask_of(cpu);
+}
+
+#ifdef CONFIG_THERMAL
+/*
+ * Closed loop thermal control. Every period_ms a work item reads one thermal
+ * zone and a PID controller sets the idle share of the synchronized duty
+ * cycle of every cpu, in per mille of INJECTION_THERMAL_PERIOD_MS. The error
+ * is in millidegrees, the gains in per mille of idle per degree (integral
+ * per degree and period, derivative per degree change in a period). The
+ * controller engages at the setpoint and lets go, resetting its integral,
+ * hysteresis below it; the output never moves more than max_step per period.
+ * While it is on, it owns the duty cycle written through sched_duty: it
+ * does not start over a duty cycle that is already set, and switching it off
+ * only clears the one it applied.
+ */
+struct thermal_controller {
+	int zone; /*thermal zone id, -1 when the controller is off*/
+	long setpoint; /*millidegrees Celsius*/
+	long hysteresis;
+	unsigned int period_ms;
+	long kp, ki, kd;
+	long max_step;
+	long temp; /*last temperature read*/
+	long integral;
+	long last_error;
+	long output; /*per mille of idle currently applied*/
+	bool engaged;
+};
+
+static struct thermal_controller thermal_ctl = {
+	.zone = -1,
+	.setpoint = 80000,
+	.hysteresis = 2000,
+	.period_ms = 100,
+	.kp = 20,
+	.ki = 2,
+	.kd = 0,
+	.max_step = 100,
+};
+static DEFINE_MUTEX(thermal_ctl_lock);
+
+static void thermal_ctl_apply(long output)
+{
+	unsigned int idle_us = output * INJECTION_THERMAL_PERIOD_MS;
+	int cpu;
+
+	get_online_cpus();
+	for_each_possible_cpu(cpu)
+		set_idle_inject_duty(cpu, idle_us, INJECTION_THERMAL_PERIOD_MS, 'p');
+	put_online_cpus();
+}
+
+/* Whether some cpu injects idle the controller did not ask for */
+static bool thermal_ctl_duty_taken(struct thermal_controller *c)
+{
+	int cpu;
+
+	if (c->output)
+		return false;
+	for_each_possible_cpu(cpu) {
+		if (cpu_rq(cpu)->idle_inject_us)
+			return true;
+	}
+	return false;
+}
+
+static void thermal_ctl_step(struct thermal_controller *c, long temp)
+{
+	long error = temp - c->setpoint;
+	long target = 0;
+
+	c->temp = temp;
+	if (!c->engaged && error >= 0)
+		c->engaged = true;
+	else if (c->engaged && error < -c->hysteresis) {
+		c->engaged = false;
+		c->integral = 0;
+	}
+	if (c->engaged) {
+		if (c->ki) {
+			long limit = INJECTION_THERMAL_MAX_PERMILLE * 1000L / c->ki;
+
+			c->integral = clamp(c->integral + error, -limit, limit);
+		}
+		target = (c->kp * error + c->ki * c->integral +
+			  c->kd * (error - c->last_error)) / 1000;
+	}
+	c->last_error = error;
+	target = clamp(target, 0L, (long)INJECTION_THERMAL_MAX_PERMILLE);
+	target = clamp(target, c->output - c->max_step, c->output + c->max_step);
+	if (target != c->output) {
+		c->output = target;
+		thermal_ctl_apply(target);
+	}
+}
+
+static void thermal_ctl_fn(struct work_struct *work);
+static DECLARE_DELAYED_WORK(thermal_ctl_work, thermal_ctl_fn);
+
+static void thermal_ctl_fn(struct work_struct *work)
+{
+	struct thermal_controller *c = &thermal_ctl;
+	unsigned long temp;
+
+	mutex_lock(&thermal_ctl_lock);
+	if (c->zone < 0)
+		goto out;
+	if (thermal_zone_get_temp_by_id(c->zone, &temp) == 0)
+		thermal_ctl_step(c, temp);
+	else
+		printk_ratelimited("BFSIDLEINJ: thermal zone %d can't be read\n", c->zone);
+	schedule_delayed_work(&thermal_ctl_work, msecs_to_jiffies(c->period_ms));
+out:
+	mutex_unlock(&thermal_ctl_lock);
+}
+
+/*
+ * One thermal cooling device per package, so that the passive trip points
+ * of the thermal zones can drive the injection directly. State n idles
+ * n / INJECTION_COOLING_STATES of the largest share the controller above
+ * uses, on every cpu of the package and in sync. The state is kept in the
+ * per-cpu slot of the first cpu of the package, which is the devdata.
+ */
+static DEFINE_PER_CPU(unsigned long, idle_inject_cooling_state);
+
+static int idle_inject_cooling_get_max_state(struct thermal_cooling_device *cdev,
+					     unsigned long *state)
+{
+	*state = INJECTION_COOLING_STATES;
+	return 0;
+}
+
+static int idle_inject_cooling_get_cur_state(struct thermal_cooling_device *cdev,
+					     unsigned long *state)
+{
+	*state = per_cpu(idle_inject_cooling_state, (long)cdev->devdata);
+	return 0;
+}
+
+static int idle_inject_cooling_set_cur_state(struct thermal_cooling_device *cdev,
+					     unsigned long state)
+{
+	int cpu = (long)cdev->devdata;
+	unsigned int idle_us;
+	int i;
+
+	if (state > INJECTION_COOLING_STATES)
+		return -EINVAL;
+	per_cpu(idle_inject_cooling_state, cpu) = state;
+	idle_us = state * INJECTION_THERMAL_MAX_PERMILLE *
+		  INJECTION_THERMAL_PERIOD_MS / INJECTION_COOLING_STATES;
+	get_online_cpus();
+	for_each_cpu(i, topology_core_cpumask(cpu))
+		set_idle_inject_duty(i, idle_us, INJECTION_THERMAL_PERIOD_MS, 'p');
+	put_online_cpus();
+	return 0;
+}
+
+static const struct thermal_cooling_device_ops idle_inject_cooling_ops = {
+	.get_max_state = idle_inject_cooling_get_max_state,
+	.get_cur_state = idle_inject_cooling_get_cur_state,
+	.set_cur_state = idle_inject_cooling_set_cur_state,
+};
+
+static int __init idle_inject_cooling_init(void)
+{
+	struct thermal_cooling_device *cdev;
+	int cpu;
+
+	get_online_cpus();
+	for_each_online_cpu(cpu) {
+		if (cpumask_first(topology_core_cpumask(cpu)) != cpu)
+			continue;
+		cdev = thermal_cooling_device_register("bfs_idle_inject",
+					(void *)(long)cpu, &idle_inject_cooling_ops);
+		if (IS_ERR(cdev))
+			printk("BFSIDLEINJ: cooling device of cpu %d hasn't been registered\n", cpu);
+	}
+	put_online_cpus();
+	return 0;
+}
+late_initcall(idle_inject_cooling_init);
+#endif /* CONFIG_THERMAL */
+
+/*
+ * Tells the cpuidle governor of the local cpu how many us are left of the
+ * injected idle window it is about to fill, and the shallowest state it may
+ * use for it. Returns 0 when the cpu is idle on its own.
+ */
+unsigned int sched_idle_inject_hint(int *min_state)
+{
+	struct rq *rq = this_rq();
+	s64 left;
+
+	if (!rq->idle_inject_forced)
+		return 0;
+	left = ktime_to_us(hrtimer_expires_remaining(&rq->idle_inject_end_timer));
+	if (left <= 0)
+		return 0;
+	*min_state = rq->idle_inject_min_state;
+	return left;
+}
+
+static void init_idle_inject_timers(struct rq *rq)
+{
+	hrtimer_init(&rq->idle_inject_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	rq->idle_inject_timer.function = idle_inject_start;
+	hrtimer_init(&rq->idle_inject_end_timer, CLOCK_MONOTONIC,
+		     HRTIMER_MODE_REL);
+	rq->idle_inject_end_timer.function = idle_inject_end;
+}
+
+/*Function that allows people from userspace to read data
+ * from the kernel (read the global rate of injection)*/
+static int proc_read_idleGlobal(char *page, char **start,
+			off_t off, int count, 
+			int *eof, void *data){	
+			
+	int len;
+
+	spin_lock(&global_write_lock);
+	len = sprintf(page, "Global_rate = %d\n", param.global_rate);
+	spin_unlock(&global_write_lock);
+	return len;
+}
+
+/*Function that allows people from userspace to read data
+ * from the kernel (read the per-cpu duty cycles of injection)*/
+static int proc_read_idleDuty(char *page, char **start,
+			off_t off, int count,
+			int *eof, void *data){
+	int len = 0;
+	int cpu;
+
+	len += scnprintf(page, PAGE_SIZE, "%s\n\n",
+			"Format Type: cpu,idle_us,period_ms,sync");
+	for_each_online_cpu(cpu) {
+		struct rq *rq = cpu_rq(cpu);
+
+		len += scnprintf(page + len, PAGE_SIZE - len, "%d,%u,%u,%c\n",
+				cpu, rq->idle_inject_us,
+				rq->idle_inject_period_ms,
+				rq->idle_inject_sync);
+	}
+	return len;
+}
+
+#ifdef CONFIG_THERMAL
+/*Function that allows people from userspace to read data
+ * from the kernel (read the thermal controller configuration and state)*/
+static int proc_read_idleThermal(char *page, char **start,
+			off_t off, int count,
+			int *eof, void *data){
+	struct thermal_controller *c = &thermal_ctl;
+	int len = 0;
+
+	mutex_lock(&thermal_ctl_lock);
+	len += scnprintf(page, PAGE_SIZE, "%s\n\n",
+			"Format Type: zone,setpoint,hysteresis,period_ms,kp,ki,kd,max_step");
+	len += scnprintf(page + len, PAGE_SIZE - len, "%d,%ld,%ld,%u,%ld,%ld,%ld,%ld\n\n",
+			c->zone, c->setpoint, c->hysteresis, c->period_ms,
+			c->kp, c->ki, c->kd, c->max_step);
+	len += scnprintf(page + len, PAGE_SIZE - len, "%s\n\n%ld,%ld,%d\n",
+			"Format Type: temp,idle_permille,engaged",
+			c->temp, c->output, c->engaged);
+	mutex_unlock(&thermal_ctl_lock);
+	return len;
+}
+
+/*Function that allows people from userspace to write data
+ * to the kernel (write "zone,setpoint,hysteresis,period_ms[,kp,ki,kd[,max_step]]"
+ * with temperatures in millidegrees to hold zone at the setpoint, zone -1
+ * switches the controller off and clears the duty cycle it set; it is
+ * refused while a duty cycle written through sched_duty is active)*/
+static int proc_write_idleThermal(struct file *file,
+			const char *buffer,
+			unsigned long count,
+			void *data){
+	struct thermal_controller *c = &thermal_ctl;
+	char *buffer_ker, *buffer_ker_copy;
+	char *temp_field[8];
+	long field[8];
+	int i;
+
+	buffer_ker = kzalloc(sizeof(char) * (count + 1), GFP_KERNEL);
+	if (buffer_ker == NULL)
+		return -ENOMEM;
+	if(copy_from_user(buffer_ker, buffer, count) != 0){
+		printk("BFSIDLEINJ: copy_from_user() failed\n");
+		kfree(buffer_ker);
+		return -EFAULT;
+	}
+	buffer_ker_copy = buffer_ker;
+	for (i = 0; i < 8; i++) {
+		temp_field[i] = strsep(&buffer_ker, ",");
+		field[i] = temp_field[i] ? simple_strtol(temp_field[i], NULL, 10) : 0;
+	}
+	if (temp_field[0] != NULL && field[0] < 0) {
+		cancel_delayed_work_sync(&thermal_ctl_work);
+		mutex_lock(&thermal_ctl_lock);
+		c->zone = -1;
+		c->engaged = false;
+		if (c->output) {
+			c->output = 0;
+			thermal_ctl_apply(0);
+		}
+		mutex_unlock(&thermal_ctl_lock);
+		printk("BFSIDLEINJ: idleThermal has been switched off\n");
+		goto free;
+	}
+	if (temp_field[3] == NULL) {
+		printk("BFSIDLEINJ: The format must be zone,setpoint,hysteresis,period_ms[,kp,ki,kd[,max_step]]\n");
+		goto free;
+	}
+	if (field[1] <= 0 || field[2] < 0 || field[3] <= 0 || field[3] > MSEC_PER_SEC) {
+		printk("BFSIDLEINJ: The setpoint, hysteresis or period inserted is not valid!!!\n");
+		goto free;
+	}
+	if (temp_field[4] != NULL && (temp_field[6] == NULL ||
+	    field[4] < 0 || field[5] < 0 || field[6] < 0)) {
+		printk("BFSIDLEINJ: The gains inserted are not valid!!! they must be three and >= 0\n");
+		goto free;
+	}
+	if (temp_field[7] != NULL && field[7] <= 0) {
+		printk("BFSIDLEINJ: Max_step inserted is not valid!!! it must be > 0\n");
+		goto free;
+	}
+
+	cancel_delayed_work_sync(&thermal_ctl_work);
+	mutex_lock(&thermal_ctl_lock);
+	if (thermal_ctl_duty_taken(c)) {
+		mutex_unlock(&thermal_ctl_lock);
+		if (c->zone >= 0)
+			schedule_delayed_work(&thermal_ctl_work, 0);
+		printk("BFSIDLEINJ: idleThermal can't start, sched_duty is in use!!! write a 0 duty cycle first\n");
+		goto free;
+	}
+	c->zone = field[0];
+	c->setpoint = field[1];
+	c->hysteresis = field[2];
+	c->period_ms = field[3];
+	if (temp_field[4] != NULL) {
+		c->kp = field[4];
+		c->ki = field[5];
+		c->kd = field[6];
+	}
+	if (temp_field[7] != NULL)
+		c->max_step = field[7];
+	/* The output carries over, the rate limit moves it from there */
+	c->integral = c->last_error = 0;
+	c->engaged = false;
+	mutex_unlock(&thermal_ctl_lock);
+	schedule_delayed_work(&thermal_ctl_work, 0);
+	printk("BFSIDLEINJ: idleThermal holds zone %ld at %ld\n", field[0], field[1]);
+
+free:	kfree(buffer_ker_copy);
+
+	return count;
+}
+#endif /* CONFIG_THERMAL */
+
+/*Function that allows people from userspace to read data
+ * from the kernel (read the per-cpu shallowest cpuidle state of injected idle)*/
+static int proc_read_idleCstate(char *page, char **start,
+			off_t off, int count,
+			int *eof, void *data){
+	int len = 0;
+	int cpu;
+
+	len += scnprintf(page, PAGE_SIZE, "%s\n\n",
+			"Format Type: cpu,min_state");
+	for_each_online_cpu(cpu)
+		len += scnprintf(page + len, PAGE_SIZE - len, "%d,%d\n",
+				cpu, cpu_rq(cpu)->idle_inject_min_state);
+	return len;
+}
+
+/*Function that allows people from userspace to read data
+ * from the kernel (read the per-cpu rates of injection)*/
+static int proc_read_idleCpu(char *page, char **start,
+			off_t off, int count,
+			int *eof, void *data){
+	int len = 0;
+	int cpu;
+
+	len += scnprintf(page, PAGE_SIZE, "%s\n\n",
+			"Format Type: cpu,rate,offset,injections,length_us");
+	for_each_online_cpu(cpu) {
+		struct rq *rq = cpu_rq(cpu);
+
+		len += scnprintf(page + len, PAGE_SIZE - len, "%d,%d,%d,%lu,%u\n",
+				cpu, rq->idle_inject_rate,
+				rq->idle_inject_offset, rq->idle_inject_count,
+				rq->idle_inject_len_us);
+	}
+	return len;
+}
+
+/*Function that allows people from userspace to read data
+ * from the kernel (read the per-cpu requested and actual idle lengths,
+ * followed by the histogram of the overshoot: bucket 0 counts windows that
+ * ended less than 1us late, bucket n the ones between 2^(n-1) and 2^n us)*/
+static int proc_read_idleHist(char *page, char **start,
+			off_t off, int count,
+			int *eof, void *data){
+	int len = 0;
+	int cpu, i;
+
+	len += scnprintf(page, PAGE_SIZE, "%s\n\n",
+			"Format Type: cpu,requested_us,actual_us,overshoot histogram");
+	for_each_online_cpu(cpu) {
+		struct rq *rq = cpu_rq(cpu);
+
+		len += scnprintf(page + len, PAGE_SIZE - len, "%d,%llu,%llu,",
+				cpu,
+				(unsigned long long)div_u64(rq->idle_inject_req_ns, NSEC_PER_USEC),
+				(unsigned long long)div_u64(rq->idle_inject_act_ns, NSEC_PER_USEC));
+		for (i = 0; i < IDLE_INJECT_HIST_BUCKETS; i++)
+			len += scnprintf(page + len, PAGE_SIZE - len, "%s%lu",
+					i ? " " : "", rq->idle_inject_hist[i]);
+		len += scnprintf(page + len, PAGE_SIZE - len, "\n");
+	}
+	return len;
+}
+
+/*Function that allows people from userspace to read data 
+ * from the kernel (read the threads 't' and processes 'p' throttled)*/
+static int proc_read_idlePid(char *page, char **start,
+			off_t off, int count,
+			int *eof, void *data){
+	struct task_struct *g, *p;
+	int len = 0;
+	int found = 0;
+
+	len += scnprintf(page, PAGE_SIZE, "%s\n\n", "Format Type: pid,max_load,times,type,mode");
+	rcu_read_lock();
+	do_each_thread(g, p) {
+		struct sched_throttle *throttle = &p->throttle;
+
+		if (throttle->max_load) {
+			len += scnprintf(page + len, PAGE_SIZE - len, "%d,%d,%d,t,%c\n",
+					p->pid, throttle->max_load, throttle->times,
+					throttle->mode);
+			found = 1;
+		}
+		throttle = &p->signal->throttle;
+		if (thread_group_leader(p) && throttle->max_load) {
+			len += scnprintf(page + len, PAGE_SIZE - len, "%d,%d,%d,p,%c\n",
+					p->tgid, throttle->max_load, throttle->times,
+					throttle->mode);
+			found = 1;
+		}
+	} while_each_thread(g, p);
+	rcu_read_unlock();
+	if (!found)
+		len += scnprintf(page + len, PAGE_SIZE - len, "%s\n", "No processes observed");
+	return len;
+}
+
+/*Function that allows people from userspace to write data
+ * to the kernel (write the global rate of injection)*/
+static int proc_write_idleGlobal(struct file *file,
+			const char *buffer,
+			unsigned long count,
+			void *data){
+	char *buffer_ker = kmalloc(sizeof(char)*count, GFP_ATOMIC);
+	memset(buffer_ker,0, sizeof(char) * count);
+	if(copy_from_user(buffer_ker,buffer,count)!=0){
+		printk("BFSIDLEINJ: copy_from_user() failed\n");
+		return -EFAULT;
+	}
+	spin_lock(&global_write_lock);
+	if((int)simple_strtol(buffer_ker, NULL, 10) >= INJECTION_IDLE_CYCLE_MIN){
+		int cpu;
+
+		param.global_rate = (int) simple_strtol(buffer_ker, NULL, 10);
+		for_each_possible_cpu(cpu)
+			set_idle_inject_rate(cpu, param.global_rate);
+	}	
+	spin_unlock(&global_write_lock);
+	printk("BFSIDLEINJ: idleGlobal has been written to %d\n",param.global_rate);
+	kfree(buffer_ker);
+	return count;
+}
+
+/*Function that allows people from userspace to write data
+ * to the kernel (write the rate of injection of one cpu as "cpu,rate" or
+ * "cpu,rate,length_us" to change the length of the injected idle too)*/
+static int proc_write_idleCpu(struct file *file,
+			const char *buffer,
+			unsigned long count,
+			void *data){
+	char *buffer_ker, *buffer_ker_copy;
+	char *temp_cpu;
+	char *temp_rate;
+	char *temp_length;
+	int cpu, rate;
+	long length_us = 0;
+
+	buffer_ker = kzalloc(sizeof(char) * (count + 1), GFP_KERNEL);
+	if (buffer_ker == NULL)
+		return -ENOMEM;
+	if(copy_from_user(buffer_ker, buffer, count) != 0){
+		printk("BFSIDLEINJ: copy_from_user() failed\n");
+		kfree(buffer_ker);
+		return -EFAULT;
+	}
+	buffer_ker_copy = buffer_ker;
+	temp_cpu = strsep(&buffer_ker, ",");
+	temp_rate = strsep(&buffer_ker, ",");
+	temp_length = strsep(&buffer_ker, ",");
+	if (temp_rate == NULL) {
+		printk("BFSIDLEINJ: The format must be cpu,rate[,length_us]\n");
+		goto free;
+	}
+	cpu = (int) simple_strtol(temp_cpu, NULL, 10);
+	rate = (int) simple_strtol(temp_rate, NULL, 10);
+	if (cpu < 0 || cpu >= nr_cpu_ids || !cpu_possible(cpu)) {
+		printk("BFSIDLEINJ: The cpu inserted is not valid!!!\n");
+		goto free;
+	}
+	if (rate != 0 && rate < INJECTION_IDLE_CYCLE_MIN) {
+		printk("BFSIDLEINJ: Rate inserted is not valid!!! it must be 0 or >= %d\n", INJECTION_IDLE_CYCLE_MIN);
+		goto free;
+	}
+	if (temp_length != NULL) {
+		length_us = simple_strtol(temp_length, NULL, 10);
+		if (length_us <= 0 || length_us > USEC_PER_SEC) {
+			printk("BFSIDLEINJ: Length inserted is not valid!!! it must be between 1 and %lu us\n", USEC_PER_SEC);
+			goto free;
+		}
+		set_idle_inject_length(cpu, length_us);
+	}
+	set_idle_inject_rate(cpu, rate);
+	printk("BFSIDLEINJ: idleCpu %d has been written to %d\n", cpu, rate);
+
+free:	kfree(buffer_ker_copy);
+
+	return count;
+}
+
+/*Function that allows people from userspace to write data
+ * to the kernel (write the shallowest cpuidle state injected idle may use as
+ * "cpu,min_state", cpu -1 means every cpu. The governor still goes deeper
+ * when the window is long enough and never breaks the pm_qos latency)*/
+static int proc_write_idleCstate(struct file *file,
+			const char *buffer,
+			unsigned long count,
+			void *data){
+	char *buffer_ker, *buffer_ker_copy;
+	char *temp_cpu;
+	char *temp_state;
+	int cpu, state;
+
+	buffer_ker = kzalloc(sizeof(char) * (count + 1), GFP_KERNEL);
+	if (buffer_ker == NULL)
+		return -ENOMEM;
+	if(copy_from_user(buffer_ker, buffer, count) != 0){
+		printk("BFSIDLEINJ: copy_from_user() failed\n");
+		kfree(buffer_ker);
+		return -EFAULT;
+	}
+	buffer_ker_copy = buffer_ker;
+	temp_cpu = strsep(&buffer_ker, ",");
+	temp_state = strsep(&buffer_ker, ",");
+	if (temp_state == NULL) {
+		printk("BFSIDLEINJ: The format must be cpu,min_state\n");
+		goto free;
+	}
+	cpu = (int) simple_strtol(temp_cpu, NULL, 10);
+	state = (int) simple_strtol(temp_state, NULL, 10);
+	if (cpu < -1 || cpu >= nr_cpu_ids || (cpu >= 0 && !cpu_possible(cpu))) {
+		printk("BFSIDLEINJ: The cpu inserted is not valid!!!\n");
+		goto free;
+	}
+	if (state < 0 || state >= CPUIDLE_STATE_MAX) {
+		printk("BFSIDLEINJ: State inserted is not valid!!! it must be between 0 and %d\n", CPUIDLE_STATE_MAX - 1);
+		goto free;
+	}
+	if (cpu == -1) {
+		for_each_possible_cpu(cpu)
+			cpu_rq(cpu)->idle_inject_min_state = state;
+	} else
+		cpu_rq(cpu)->idle_inject_min_state = state;
+	printk("BFSIDLEINJ: idleCstate has been written to %d\n", state);
+
+free:	kfree(buffer_ker_copy);
+
+	return count;
+}
+
+/*Function that allows people from userspace to write data
+ * to the kernel (write the duty cycle of one cpu as "cpu,idle_us,period_ms",
+ * cpu -1 means every cpu and idle_us 0 switches the timed injection off.
+ * An optional fourth field 's', 'c' or 'p' applies the duty cycle to all the
+ * smt, cache or package siblings of cpu and synchronizes their windows)*/
+static int proc_write_idleDuty(struct file *file,
+			const char *buffer,
+			unsigned long count,
+			void *data){
+	char *buffer_ker, *buffer_ker_copy;
+	char *temp_cpu;
+	char *temp_idle;
+	char *temp_period;
+	char *temp_sync;
+	char sync = 'n';
+	int cpu, i;
+	long idle_us, period_ms;
+
+	buffer_ker = kzalloc(sizeof(char) * (count + 1), GFP_KERNEL);
+	if (buffer_ker == NULL)
+		return -ENOMEM;
+	if(copy_from_user(buffer_ker, buffer, count) != 0){
+		printk("BFSIDLEINJ: copy_from_user() failed\n");
+		kfree(buffer_ker);
+		return -EFAULT;
+	}
+	buffer_ker_copy = buffer_ker;
+	temp_cpu = strsep(&buffer_ker, ",");
+	temp_idle = strsep(&buffer_ker, ",");
+	temp_period = strsep(&buffer_ker, ",");
+	temp_sync = strsep(&buffer_ker, ",");
+	if (temp_idle == NULL || temp_period == NULL) {
+		printk("BFSIDLEINJ: The format must be cpu,idle_us,period_ms[,sync]\n");
+		goto free;
+	}
+	if (temp_sync != NULL)
+		sync = *temp_sync;
+	if (sync != 'n' && sync != 's' && sync != 'c' && sync != 'p') {
+		printk("BFSIDLEINJ: The sync inserted is not valid!!! it must be 'n', 's', 'c' or 'p'\n");
+		goto free;
+	}
+#ifndef CONFIG_SCHED_MC
+	/* Without MC scheduling there is no cache group to synchronize on */
+	if (sync == 'c') {
+		printk("BFSIDLEINJ: The sync 'c' needs CONFIG_SCHED_MC\n");
+		goto free;
+	}
+#endif
+	cpu = (int) simple_strtol(temp_cpu, NULL, 10);
+	idle_us = simple_strtol(temp_idle, NULL, 10);
+	period_ms = simple_strtol(temp_period, NULL, 10);
+	if (cpu < -1 || cpu >= nr_cpu_ids || (cpu >= 0 && !cpu_possible(cpu))) {
+		printk("BFSIDLEINJ: The cpu inserted is not valid!!!\n");
+		goto free;
+	}
+	if (idle_us < 0 || period_ms <= 0 || period_ms > INT_MAX / USEC_PER_MSEC ||
+	    idle_us >= period_ms * USEC_PER_MSEC) {
+		printk("BFSIDLEINJ: The duty cycle inserted is not valid!!! idle_us must be shorter than the period\n");
+		goto free;
+	}
+	get_online_cpus();
+	if (cpu == -1) {
+		for_each_possible_cpu(i)
+			set_idle_inject_duty(i, idle_us, period_ms, sync);
+	} else {
+		for_each_cpu(i, idle_inject_sync_mask(cpu, sync))
+			set_idle_inject_duty(i, idle_us, period_ms, sync);
+	}
+	put_online_cpus();
+	printk("BFSIDLEINJ: idleDuty has been written to %ldus every %ldms, sync %c\n", idle_us, period_ms, sync);
+
+free:	kfree(buffer_ker_copy);
+
+	return count;
+}
+
+/*Function that allows people from userspace to write data
+ * to the kernel (write "pid,max_load[,type[,mode]]" to throttle the thread
+ * 't' or the whole process 'p' with that pid, a negative pid removes it
+ * again. Mode 'i' idles the cpu when the budget runs out, 's' only skips
+ * the task in favour of the next one by deadline) */
+static int proc_write_idlePid(struct file *file,
+			const char *buffer,
+			unsigned long count,
+			void *data){
+	struct task_struct *p;
+	struct sched_throttle *throttle;
+	char *buffer_ker, *buffer_ker_copy;
+	char *temp_pid;
+	char *temp_load;
+	char *temp_type;
+	char *temp_mode;
+	int pid, max_load = 0;
+	char type = 't';
+	char mode = 'i';
+
+	buffer_ker = kzalloc(sizeof(char) * (count + 1), GFP_KERNEL);
+	if (buffer_ker == NULL)
+		return -ENOMEM;
+	if(copy_from_user(buffer_ker, buffer, count) != 0){
+		printk("BFSIDLEINJ: copy_from_user() failed\n");
+		kfree(buffer_ker);
+		return -EFAULT;
+	}
+	buffer_ker_copy = buffer_ker;
+	temp_pid = strsep(&buffer_ker, ",");
+	temp_load = strsep(&buffer_ker, ",");
+	temp_type = strsep(&buffer_ker, ",");
+	temp_mode = strsep(&buffer_ker, ",");
+	if (temp_load == NULL) {
+		printk("BFSIDLEINJ: The format must be pid,max_load[,type[,mode]]\n");
+		goto free;
+	}
+	pid = (int) simple_strtol(temp_pid, NULL, 10);
+	if (temp_type != NULL)
+		type = *temp_type;
+	if ((type != 't') && (type != 'p')) {
+		printk("BFSIDLEINJ: The type inserted is not valid!!! it must be either 't' or 'p'\n");
+		goto free;
+	}
+	if (temp_mode != NULL)
+		mode = *temp_mode;
+	if ((mode != 'i') && (mode != 's')) {
+		printk("BFSIDLEINJ: The mode inserted is not valid!!! it must be either 'i' or 's'\n");
+		goto free;
+	}
+	if (pid > 0) {
+		max_load = (int) simple_strtol(temp_load, NULL, 10);
+		if (max_load < INJECTION_IDLE_CYCLE_PROC) {
+			printk("BFSIDLEINJ: Max_load inserted is not valid!!! it must be >= %d\n", INJECTION_IDLE_CYCLE_PROC);
+			goto free;
+		}
+	}
+
+	if (pid < 0)
+		pid = -pid;
+	rcu_read_lock();
+	p = pid ? find_task_by_vpid(pid) : NULL;
+	if (p == NULL) {
+		rcu_read_unlock();
+		printk("BFSIDLEINJ: No task with pid = %d\n", pid);
+		goto free;
+	}
+	throttle = type == 'p' ? &p->signal->throttle : &p->throttle;
+	throttle->times = 0;
+	throttle->mode = mode;
+	throttle->max_load = max_load;
+	rcu_read_unlock();
+	if (max_load)
+		printk("BFSIDLEINJ: Max_load updated to %d of pid = %d\n", max_load, pid);
+	else
+		printk("BFSIDLEINJ: Element removed\n");
+
+free:	kfree(buffer_ker_copy);
+
+	return count;
+}
+
+static struct proc_dir_entry *schedidle_file_global, *schedidle_file_pid, *schedidle_dir;
+static struct proc_dir_entry *schedidle_file_cpu, *schedidle_file_duty;
+static struct proc_dir_entry *schedidle_file_hist, *schedidle_file_cstate;
+#ifdef CONFIG_THERMAL
+static struct proc_dir_entry *schedidle_file_thermal;
+#endif
 
-#include "sched_stats.h"
+/*Function that create the proc files. The parameters themselves are
+ * statically initialized and the per-cpu rates are set in sched_init()
+ */
+static int __init set_everything_idlepar(void)
+{
+	//creation of the directory where put the files
+	schedidle_dir = proc_mkdir("schedidle",NULL);
+	if(schedidle_dir == NULL){
+		printk("BFSIDLEINJ: /proc/schedidle hasn't been created\n");
+		goto end;
+	}
+	schedidle_dir->uid = 0;
+	schedidle_dir->gid = 0;
+	//creation of the global param file inside /proc/schedidle
+	schedidle_file_global = create_proc_entry("sched_global", 0644, schedidle_dir);
+	if(schedidle_file_global == NULL){
+		printk("BFSIDLEINJ: /proc/schedidle/sched_global file hasn't been created\n");
+		goto end;
+	}
+	schedidle_file_global->uid = 0;
+	schedidle_file_global->gid = 0;
+	schedidle_file_global->data = &param;
+	schedidle_file_global->read_proc = proc_read_idleGlobal;
+	schedidle_file_global->write_proc = proc_write_idleGlobal;
+	//creation of the Pid file inside /proc/schedidle
+	schedidle_file_pid = create_proc_entry("sched_pid", 0644, schedidle_dir);
+	if(schedidle_file_pid == NULL){
+		printk("BFSIDLEINJ: /proc/schedidle/sched_pid file hasn't been created\n");
+		goto end;
+	}
+	schedidle_file_pid->uid = 0;
+	schedidle_file_pid->gid = 0;
+	schedidle_file_pid->read_proc = proc_read_idlePid;
+	schedidle_file_pid->write_proc = proc_write_idlePid;
+	//creation of the per-cpu file inside /proc/schedidle
+	schedidle_file_cpu = create_proc_entry("sched_cpu", 0644, schedidle_dir);
+	if(schedidle_file_cpu == NULL){
+		printk("BFSIDLEINJ: /proc/schedidle/sched_cpu file hasn't been created\n");
+		goto end;
+	}
+	schedidle_file_cpu->uid = 0;
+	schedidle_file_cpu->gid = 0;
+	schedidle_file_cpu->read_proc = proc_read_idleCpu;
+	schedidle_file_cpu->write_proc = proc_write_idleCpu;
+	//creation of the duty cycle file inside /proc/schedidle
+	schedidle_file_duty = create_proc_entry("sched_duty", 0644, schedidle_dir);
+	if(schedidle_file_duty == NULL){
+		printk("BFSIDLEINJ: /proc/schedidle/sched_duty file hasn't been created\n");
+		goto end;
+	}
+	schedidle_file_duty->uid = 0;
+	schedidle_file_duty->gid = 0;
+	schedidle_file_duty->read_proc = proc_read_idleDuty;
+	schedidle_file_duty->write_proc = proc_write_idleDuty;
+	//creation of the read only histogram file inside /proc/schedidle
+	schedidle_file_hist = create_proc_entry("sched_hist", 0444, schedidle_dir);
+	if(schedidle_file_hist == NULL){
+		printk("BFSIDLEINJ: /proc/schedidle/sched_hist file hasn't been created\n");
+		goto end;
+	}
+	schedidle_file_hist->uid = 0;
+	schedidle_file_hist->gid = 0;
+	schedidle_file_hist->read_proc = proc_read_idleHist;
+	//creation of the cpuidle state file inside /proc/schedidle
+	schedidle_file_cstate = create_proc_entry("sched_cstate", 0644, schedidle_dir);
+	if(schedidle_file_cstate == NULL){
+		printk("BFSIDLEINJ: /proc/schedidle/sched_cstate file hasn't been created\n");
+		goto end;
+	}
+	schedidle_file_cstate->uid = 0;
+	schedidle_file_cstate->gid = 0;
+	schedidle_file_cstate->read_proc = proc_read_idleCstate;
+	schedidle_file_cstate->write_proc = proc_write_idleCstate;
+#ifdef CONFIG_THERMAL
+	//creation of the thermal controller file inside /proc/schedidle
+	schedidle_file_thermal = create_proc_entry("sched_thermal", 0644, schedidle_dir);
+	if(schedidle_file_thermal == NULL){
+		printk("BFSIDLEINJ: /proc/schedidle/sched_thermal file hasn't been created\n");
+		goto end;
+	}
+	schedidle_file_thermal->uid = 0;
+	schedidle_file_thermal->gid = 0;
+	schedidle_file_thermal->read_proc = proc_read_idleThermal;
+	schedidle_file_thermal->write_proc = proc_write_idleThermal;
+#endif
+  end:  printk("BFSIDLEINJ: Procfs Schedidle initialization Completed\n");
+	return 0;
+}
+late_initcall(set_everything_idlepar);
+/*End of the definition procfs parameters managing */
 
 #ifndef prepare_arch_switch
 # define prepare_arch_switch(next)	do { } while (0)
@@ -906,14 +1791,88 @@ static inline bool task_queued(struct task_struct *p)
 	return (!list_empty(&p->run_list));
 }
 
+#ifdef CONFIG_SMP
+#define task_edf(p)	((p)->edf)
+#define set_task_edf(p, q)	((p)->edf = (q))
+
+/*
+ * Tasks allowed on a single cpu are queued on the pinned queue of that cpu,
+ * which no other cpu looks at, the others on grq.edf.
+ * Real time tasks always stay on the shared lists: two queues could not
+ * keep the FIFO order between tasks of the same priority.
+ */
+static inline struct edf_queue *select_edf(struct task_struct *p)
+{
+	int cpu = cpumask_first(tsk_cpus_allowed(p));
+
+	if (p->prio >= MAX_RT_PRIO &&
+	    cpumask_next(cpu, tsk_cpus_allowed(p)) >= nr_cpu_ids)
+		return &cpu_rq(cpu)->pinned;
+	return &grq.edf;
+}
+#else
+#define task_edf(p)	(&grq.edf)
+#define set_task_edf(p, q)	do { } while (0)
+#define select_edf(p)	(&grq.edf)
+#endif
+
+static void init_edf_queue(struct edf_queue *edf)
+{
+	int i;
+
+	for (i = 0; i < PRIO_LIMIT; i++)
+		INIT_LIST_HEAD(edf->queue + i);
+	for (i = 0; i < PRIO_LIMIT - MAX_RT_PRIO; i++)
+		edf->deadlines[i] = RB_ROOT;
+	bitmap_zero(edf->prio_bitmap, PRIO_LIMIT);
+	/* delimiter for bitsearch */
+	__set_bit(PRIO_LIMIT, edf->prio_bitmap);
+}
+
+/*
+ * Tasks of the same deadline are kept in the order they were queued.
+ */
+static void edf_add_deadline(struct edf_queue *edf, struct task_struct *p)
+{
+	struct rb_node **link, *parent = NULL;
+	struct rb_root *root;
+
+	if (p->prio < MAX_RT_PRIO)
+		return;
+	root = edf->deadlines + p->prio - MAX_RT_PRIO;
+	link = &root->rb_node;
+	while (*link) {
+		struct task_struct *entry;
+
+		parent = *link;
+		entry = rb_entry(parent, struct task_struct, deadline_node);
+		if (deadline_before(p->deadline, entry->deadline))
+			link = &parent->rb_left;
+		else
+			link = &parent->rb_right;
+	}
+	rb_link_node(&p->deadline_node, parent, link);
+	rb_insert_color(&p->deadline_node, root);
+}
+
+static void edf_del_deadline(struct edf_queue *edf, struct task_struct *p)
+{
+	if (p->prio < MAX_RT_PRIO)
+		return;
+	rb_erase(&p->deadline_node, edf->deadlines + p->prio - MAX_RT_PRIO);
+}
+
 /*
  * Removing from the global runqueue. Enter with grq locked.
  */
 static void dequeue_task(struct task_struct *p)
 {
+	struct edf_queue *edf = task_edf(p);
+
+	edf_del_deadline(edf, p);
 	list_del_init(&p->run_list);
-	if (list_empty(grq.queue + p->prio))
-		__clear_bit(p->prio, grq.prio_bitmap);
+	if (list_empty(edf->queue + p->prio))
+		__clear_bit(p->prio, edf->prio_bitmap);
 }
 
 /*
@@ -936,10 +1895,12 @@ static bool isoprio_suitable(void)
 }
 
 /*
- * Adding to the global runqueue. Enter with grq locked.
+ * Adding to the global runqueue, see select_edf(). Enter with grq locked.
  */
 static void enqueue_task(struct task_struct *p)
 {
+	struct edf_queue *edf;
+
 	if (!rt_task(p)) {
 		/* Check it hasn't gotten rt from PI */
 		if ((idleprio_task(p) && idleprio_suitable(p)) ||
@@ -948,16 +1909,23 @@ static void enqueue_task(struct task_struct *p)
 		else
 			p->prio = NORMAL_PRIO;
 	}
-	__set_bit(p->prio, grq.prio_bitmap);
-	list_add_tail(&p->run_list, grq.queue + p->prio);
+	edf = select_edf(p);
+	set_task_edf(p, edf);
+	__set_bit(p->prio, edf->prio_bitmap);
+	list_add_tail(&p->run_list, edf->queue + p->prio);
+	edf_add_deadline(edf, p);
 	sched_info_queued(p);
 }
 
 /* Only idle task does this as a real time task*/
 static inline void enqueue_task_head(struct task_struct *p)
 {
-	__set_bit(p->prio, grq.prio_bitmap);
-	list_add(&p->run_list, grq.queue + p->prio);
+	struct edf_queue *edf = select_edf(p);
+
+	set_task_edf(p, edf);
+	__set_bit(p->prio, edf->prio_bitmap);
+	list_add(&p->run_list, edf->queue + p->prio);
+	edf_add_deadline(edf, p);
 	sched_info_queued(p);
 }
 
@@ -1012,11 +1980,19 @@ static inline int queued_notrunning(void)
  * It's cheaper to maintain a binary yes/no if there are any idle CPUs on the
  * idle_cpus variable than to do a full bitmask check when we are busy.
  */
+/*
+ * The idle CPUs of cpu_idle_map that no waker has claimed yet. It is only
+ * updated with atomic bitops so wakers can claim an idle CPU without the
+ * grq lock, see claim_idle_cpu().
+ */
+static cpumask_t cpu_idle_unclaimed ____cacheline_aligned_in_smp;
+
 static inline void set_cpuidle_map(int cpu)
 {
 	if (likely(cpu_online(cpu))) {
 		cpu_set(cpu, grq.cpu_idle_map);
 		grq.idle_cpus = true;
+		cpumask_set_cpu(cpu, &cpu_idle_unclaimed);
 	}
 }
 
@@ -1025,6 +2001,35 @@ static inline void clear_cpuidle_map(int cpu)
 	cpu_clear(cpu, grq.cpu_idle_map);
 	if (cpus_empty(grq.cpu_idle_map))
 		grq.idle_cpus = false;
+	cpumask_clear_cpu(cpu, &cpu_idle_unclaimed);
+}
+
+/*
+ * Claim an idle CPU p can run on with a single atomic test and clear, so
+ * that concurrent wakers never kick the same one. The task's own CPU comes
+ * first, then the CPUs sharing its last level cache, then any other.
+ * Returns -1 when there are none left.
+ */
+static int claim_idle_cpu(struct task_struct *p)
+{
+	unsigned long *unclaimed = cpumask_bits(&cpu_idle_unclaimed);
+	int cpu = task_cpu(p);
+
+	if (cpumask_test_cpu(cpu, tsk_cpus_allowed(p)) &&
+	    test_and_clear_bit(cpu, unclaimed))
+		return cpu;
+#ifdef CONFIG_SCHED_MC
+	for_each_cpu_and(cpu, &task_rq(p)->cache_siblings, &cpu_idle_unclaimed) {
+		if (cpumask_test_cpu(cpu, tsk_cpus_allowed(p)) &&
+		    test_and_clear_bit(cpu, unclaimed))
+			return cpu;
+	}
+#endif
+	for_each_cpu_and(cpu, tsk_cpus_allowed(p), &cpu_idle_unclaimed) {
+		if (test_and_clear_bit(cpu, unclaimed))
+			return cpu;
+	}
+	return -1;
 }
 
 static bool suitable_idle_cpus(struct task_struct *p)
@@ -1102,14 +2107,22 @@ resched_best_mask(int best_cpu, struct rq *rq, cpumask_t *tmpmask)
 		}
 	}
 out:
+	/* Claimed, see claim_idle_cpu() */
+	cpumask_clear_cpu(best_cpu, &cpu_idle_unclaimed);
 	resched_task(cpu_rq(best_cpu)->curr);
 }
 
+/*
+ * Idle CPUs already claimed by a waker are only kicked again when all of
+ * them are.
+ */
 static void resched_best_idle(struct task_struct *p)
 {
 	cpumask_t tmpmask;
 
-	cpus_and(tmpmask, p->cpus_allowed, grq.cpu_idle_map);
+	cpus_and(tmpmask, p->cpus_allowed, cpu_idle_unclaimed);
+	if (cpus_empty(tmpmask))
+		cpus_and(tmpmask, p->cpus_allowed, grq.cpu_idle_map);
 	resched_best_mask(task_cpu(p), task_rq(p), &tmpmask);
 }
 
@@ -1306,7 +2319,9 @@ resched_closest_idle(struct rq *rq, int cpu, struct task_struct *p)
 {
 	cpumask_t tmpmask;
 
-	cpus_and(tmpmask, p->cpus_allowed, grq.cpu_idle_map);
+	cpus_and(tmpmask, p->cpus_allowed, cpu_idle_unclaimed);
+	if (cpus_empty(tmpmask))
+		cpus_and(tmpmask, p->cpus_allowed, grq.cpu_idle_map);
 	cpu_clear(cpu, tmpmask);
 	if (cpus_empty(tmpmask))
 		return;
@@ -1745,20 +2760,89 @@ ttwu_stat(struct task_struct *p, int cpu, int wake_flags)
 #endif /* CONFIG_SCHEDSTATS */
 }
 
-static inline void ttwu_activate(struct task_struct *p, struct rq *rq,
+#ifdef CONFIG_SMP
+/*
+ * Returns true when p should be handed to an idle CPU, which is then chosen
+ * and kicked by ttwu_idle() once the grq lock is dropped.
+ */
+static inline bool ttwu_activate(struct task_struct *p, struct rq *rq,
 				 bool is_sync)
 {
 	activate_task(p, rq);
 
+	if (suitable_idle_cpus(p)) {
+		clear_sticky(p);
+		return true;
+	}
+
 	/*
 	 * Sync wakeups (i.e. those types of wakeups where the waker
 	 * has indicated that it will leave the CPU in short order)
 	 * don't trigger a preemption if there are no idle cpus,
 	 * instead waiting for current to deschedule.
 	 */
+	if (!is_sync)
+		try_preempt(p, rq);
+	return false;
+}
+
+/*
+ * Kick an idle CPU claimed by claim_idle_cpu() without the grq lock. Like in
+ * wake_up_idle_cpu(), the worst case is a NOOP schedule() of its idle task.
+ */
+static void kick_idle_cpu(int cpu)
+{
+	struct task_struct *idle = cpu_rq(cpu)->idle;
+
+	set_tsk_need_resched(idle);
+	if (cpu == smp_processor_id())
+		return;
+	/* NEED_RESCHED must be visible before we test polling */
+	smp_mb();
+	if (!tsk_is_polling(idle))
+		smp_send_reschedule(cpu);
+}
+
+static void ttwu_idle(struct task_struct *p)
+{
+	unsigned long flags;
+	int cpu;
+
+	cpu = claim_idle_cpu(p);
+	if (likely(cpu >= 0)) {
+		kick_idle_cpu(cpu);
+		return;
+	}
+
+	/* Other wakers claimed them all meanwhile, look for a cpu to preempt */
+	grq_lock_irqsave(&flags);
+	if (task_queued(p))
+		try_preempt(p, task_rq(p));
+	grq_unlock_irqrestore(&flags);
+}
+#else
+static inline bool ttwu_activate(struct task_struct *p, struct rq *rq,
+				 bool is_sync)
+{
+	activate_task(p, rq);
 	if (!is_sync || suitable_idle_cpus(p))
 		try_preempt(p, rq);
+	return false;
+}
+
+static inline int claim_idle_cpu(struct task_struct *p)
+{
+	return -1;
+}
+
+static inline void kick_idle_cpu(int cpu)
+{
+}
+
+static inline void ttwu_idle(struct task_struct *p)
+{
 }
+#endif
 
 static inline void ttwu_post_activation(struct task_struct *p, struct rq *rq,
 					bool success)
@@ -1799,7 +2883,7 @@ void scheduler_ipi(void)
 static bool try_to_wake_up(struct task_struct *p, unsigned int state,
 			  int wake_flags)
 {
-	bool success = false;
+	bool success = false, kick_idle = false;
 	unsigned long flags;
 	struct rq *rq;
 	int cpu;
@@ -1823,7 +2907,10 @@ static bool try_to_wake_up(struct task_struct *p, unsigned int state,
 	if (task_queued(p) || task_running(p))
 		goto out_running;
 
-	ttwu_activate(p, rq, wake_flags & WF_SYNC);
+	kick_idle = ttwu_activate(p, rq, wake_flags & WF_SYNC);
+	/* p may run, exit and be freed once grq is unlocked */
+	if (kick_idle)
+		get_task_struct(p);
 	success = true;
 
 out_running:
@@ -1831,6 +2918,11 @@ out_running:
 out_unlock:
 	task_grq_unlock(&flags);
 
+	if (kick_idle) {
+		ttwu_idle(p);
+		put_task_struct(p);
+	}
+
 	ttwu_stat(p, cpu, wake_flags);
 
 	put_cpu();
@@ -1838,6 +2930,42 @@ out_unlock:
 	return success;
 }
 
+/*
+ * try_to_wake_up() for callers already holding the grq lock, so several
+ * tasks can be woken with a single lock hold, see __wake_up_common(). Each
+ * woken task claims a different idle CPU, added to kick for the caller to
+ * kick once the lock is released.
+ */
+static bool try_to_wake_up_locked(struct task_struct *p, unsigned int state,
+				  int wake_flags, cpumask_t *kick)
+{
+	struct rq *rq = task_rq(p);
+	bool success = false;
+	int cpu = task_cpu(p);
+	int idle_cpu;
+
+	lockdep_assert_held(&grq.lock);
+
+	smp_wmb();
+	if (!((unsigned int)p->state & state))
+		return false;
+
+	if (!task_queued(p) && !task_running(p)) {
+		if (ttwu_activate(p, rq, wake_flags & WF_SYNC)) {
+			idle_cpu = claim_idle_cpu(p);
+			if (idle_cpu >= 0)
+				cpumask_set_cpu(idle_cpu, kick);
+			else
+				try_preempt(p, rq);
+		}
+		success = true;
+	}
+	ttwu_post_activation(p, rq, success);
+	ttwu_stat(p, cpu, wake_flags);
+
+	return success;
+}
+
 /**
  * try_to_wake_up_local - try to wake up a local task with grq lock held
  * @p: the thread to be awakened
@@ -1861,7 +2989,9 @@ static void try_to_wake_up_local(struct task_struct *p)
 			schedstat_inc(rq, ttwu_count);
 			schedstat_inc(rq, ttwu_local);
 		}
-		ttwu_activate(p, rq, false);
+		/* The grq lock is held, no lockless idle kick here */
+		if (ttwu_activate(p, rq, false))
+			resched_suitable_idle(p);
 		ttwu_stat(p, smp_processor_id(), 0);
 		success = true;
 	}
@@ -1915,6 +3045,9 @@ void sched_fork(struct task_struct *p)
 
 	/* Should be reset in fork.c but done here for ease of bfs patching */
 	p->sched_time = p->stime_pc = p->utime_pc = 0;
+	/* Throttles are set by tid, a new process gets a zeroed signal_struct */
+	p->throttle.max_load = p->throttle.times = 0;
+	p->throttle.hrm_max_load = 0;
 
 	/*
 	 * Revert to default priority/policy on fork if requested.
@@ -3069,6 +4202,9 @@ void scheduler_tick(void)
 	/* grq lock not grabbed, so only update rq clock */
 	update_rq_clock(rq);
 	update_cpu_clock(rq, rq->curr, 1);
+#ifdef CONFIG_HRM
+	hrm_fold_task(rq->curr);
+#endif
 	if (!rq_idle(rq))
 		task_running_tick(rq);
 	else
@@ -3168,6 +4304,24 @@ static inline int ms_longest_deadline_diff(void)
 	return NS_TO_MS(longest_deadline_diff());
 }
 
+#ifdef CONFIG_HRM
+static inline u64 hrm_deadline_diff(struct task_struct *p)
+{
+	u64 diff = task_deadline_diff(p);
+	int slack;
+
+	if (!sched_hrm_boost)
+		return diff;
+	slack = hrm_task_slack(p);
+	if (slack == HRM_NO_SLACK)
+		return diff;
+
+	return div_u64(diff * (1000 + slack * sched_hrm_boost / 100), 1000);
+}
+#else
+#define hrm_deadline_diff(p) task_deadline_diff(p)
+#endif
+
 /*
  * The time_slice is only refilled when it is empty and that is when we set a
  * new deadline.
@@ -3175,7 +4329,7 @@ static inline int ms_longest_deadline_diff(void)
 static void time_slice_expired(struct task_struct *p)
 {
 	p->time_slice = timeslice();
-	p->deadline = grq.niffies + task_deadline_diff(p);
+	p->deadline = grq.niffies + hrm_deadline_diff(p);
 }
 
 /*
@@ -3194,11 +4348,11 @@ static inline void check_deadline(struct task_struct *p)
 }
 
 /*
- * O(n) lookup of all tasks in the global runqueue. The real brainfuck
- * of lock contention and O(n). It's not really O(n) as only the queued,
- * but not running tasks are scanned, and is O(n) queued in the worst case
- * scenario only because the right task can be found before scanning all of
- * them.
+ * Lookup of the best task of one queue for this cpu. Real time tasks are
+ * found in the priority lists, the others by walking the deadline tree of
+ * their priority in order, so the walk stops at the first task this cpu can
+ * run unless affinity, throttling or the sticky bias rule it out. It is only
+ * O(n) queued in the worst case scenario.
  * Tasks are selected in this order:
  * Real time tasks are selected purely by their static priority and in the
  * order they were queued, so the lowest value idx, and the first queued task
@@ -3210,39 +4364,53 @@ static inline void check_deadline(struct task_struct *p)
  * earliest deadline.
  * Finally if no SCHED_NORMAL tasks are found, SCHED_IDLEPRIO tasks are
  * selected by the earliest deadline.
+ * The priority and the deadline it was chosen by are returned in idx and dl.
  */
-static inline struct
-task_struct *earliest_deadline_task(struct rq *rq, int cpu, struct task_struct *idle)
+static struct task_struct *
+edf_queue_best(struct edf_queue *edf, struct rq *rq, int cpu, u64 pick,
+	       struct task_struct *idle, int *idx, u64 *dl)
 {
-	u64 dl, uninitialized_var(earliest_deadline);
+	u64 uninitialized_var(earliest_deadline);
 	struct task_struct *p, *edt = idle;
 	struct list_head *queue;
-	int idx = 0;
+	struct rb_node *node;
+	int i = 0;
 
 retry:
-	idx = find_next_bit(grq.prio_bitmap, PRIO_LIMIT, idx);
-	if (idx >= PRIO_LIMIT)
-		goto out;
-	queue = grq.queue + idx;
+	i = find_next_bit(edf->prio_bitmap, PRIO_LIMIT, i);
+	if (i >= PRIO_LIMIT)
+		return idle;
+	queue = edf->queue + i;
 
-	if (idx < MAX_RT_PRIO) {
+	if (i < MAX_RT_PRIO) {
 		/* We found an rt task */
 		list_for_each_entry(p, queue, run_list) {
 			/* Make sure cpu affinity is ok */
 			if (needs_other_cpu(p, cpu))
-				continue;	
-			edt = p;
-			goto out_take;
+				continue;
+			*idx = i;
+			*dl = 0;
+			return p;
 		}
 		/* None of the RT tasks at this priority can run on this cpu */
-		++idx;
+		++i;
 		goto retry;
 	}
 
-	list_for_each_entry(p, queue, run_list) {
+	node = rb_first(edf->deadlines + i - MAX_RT_PRIO);
+	for (; node; node = rb_next(node)) {
+		u64 p_dl;
+
+		p = rb_entry(node, struct task_struct, deadline_node);
+		/* Nothing further along can beat the best one so far */
+		if (edt != idle && !deadline_before(p->deadline, earliest_deadline))
+			break;
 		/* Make sure cpu affinity is ok */
 		if (needs_other_cpu(p, cpu))
 			continue;
+		/* Already charged and skipped over by this very pick */
+		if (unlikely(p->throttle_skip == pick))
+			continue;
 
 		/*
 		 * Soft affinity happens here by not scheduling a task with
@@ -3254,45 +4422,104 @@ retry:
 			if (scaling_rq(rq))
 				continue;
 			else
-				dl = p->deadline + longest_deadline_diff();
+				p_dl = p->deadline + longest_deadline_diff();
 		} else
-			dl = p->deadline;
+			p_dl = p->deadline;
 
 		/*
-		 * No rt tasks. Find the earliest deadline task. Now we're in
-		 * O(n) territory. This is what we silenced the compiler for
-		 * with uninitialized_var(): edt will always start as idle.
+		 * No rt tasks. Find the earliest deadline task. This is what
+		 * we silenced the compiler for with uninitialized_var(): edt
+		 * will always start as idle.
 		 */
 		if (edt == idle ||
-		    deadline_before(dl, earliest_deadline)) {
-			earliest_deadline = dl;
+		    deadline_before(p_dl, earliest_deadline)) {
+			earliest_deadline = p_dl;
 			edt = p;
 		}
 	}
 	if (edt == idle) {
-		if (++idx < PRIO_LIMIT)
+		if (++i < PRIO_LIMIT)
 			goto retry;
+		return idle;
+	}
+	*idx = i;
+	*dl = earliest_deadline;
+	return edt;
+}
+
+#ifdef CONFIG_SMP
+/*
+ * The tasks pinned to this cpu, never real time ones, compete with the best
+ * shared one by priority and then deadline.
+ */
+static struct task_struct *
+pinned_edf_task(struct rq *rq, int cpu, u64 pick, struct task_struct *idle,
+		struct task_struct *edt, int *idx, u64 *dl)
+{
+	struct task_struct *p;
+	int p_idx;
+	u64 p_dl;
+
+	if (edt != idle &&
+	    find_first_bit(rq->pinned.prio_bitmap, PRIO_LIMIT) > *idx)
+		return edt;
+	p = edf_queue_best(&rq->pinned, rq, cpu, pick, idle, &p_idx, &p_dl);
+	if (p == idle)
+		return edt;
+	if (edt == idle || p_idx < *idx ||
+	    (p_idx == *idx && p_idx >= MAX_RT_PRIO &&
+	     deadline_before(p_dl, *dl))) {
+		*idx = p_idx;
+		*dl = p_dl;
+		return p;
+	}
+	return edt;
+}
+#else
+static inline struct task_struct *
+pinned_edf_task(struct rq *rq, int cpu, u64 pick, struct task_struct *idle,
+		struct task_struct *edt, int *idx, u64 *dl)
+{
+	return edt;
+}
+#endif
+
+/*
+ * Picks the next task of the cpu among the queued ones, see edf_queue_best()
+ * for the order, and takes it off the queue.
+ */
+static inline struct
+task_struct *earliest_deadline_task(struct rq *rq, int cpu, struct task_struct *idle)
+{
+	struct task_struct *edt;
+	u64 pick = ++grq.throttle_seq;
+	int uninitialized_var(idx);
+	u64 uninitialized_var(dl);
+	char mode;
+
+retry:
+	edt = edf_queue_best(&grq.edf, rq, cpu, pick, idle, &idx, &dl);
+	edt = pinned_edf_task(rq, cpu, pick, idle, edt, &idx, &dl);
+	if (edt == idle)
 		goto out;
-	}else{
-		/*here is the point where we check if the next scheduled process has to be changed with the idle process*/
-		spin_lock(&lst_write_lock);
-		if(!list_empty(&param.pidList->list)){
-			struct pid_list *f;
-				list_for_each_entry_rcu(f, &param.pidList->list,list){
-					if(((edt->tgid == f->pid) && (f->type == 'p')) ||
-					  (( edt->pid == f->pid) && (f->type == 't'))) {
-							f->times++;
-							if(f->times == f->max_load) {
-								f->times = 0;
-								edt = idle;
-								spin_unlock(&lst_write_lock);
-								goto out;
-							}
-					}
-				}
-			}
-				spin_unlock(&lst_write_lock);
-		}
+	if (idx < MAX_RT_PRIO)
+		goto out_take;
+
+	/*here is the point where we check if the next scheduled process has to be changed with the idle process*/
+	mode = throttle_due(&edt->throttle);
+	if (!mode)
+		mode = throttle_due(&edt->signal->throttle);
+	if (unlikely(mode == 'i')) {
+		edt = idle;
+		goto out;
+	} else if (unlikely(mode == 's')) {
+		/*
+		 * Its budget is charged: look again for the next best task,
+		 * and idle only when none is left.
+		 */
+		edt->throttle_skip = pick;
+		goto retry;
+	}
 
 out_take:
 	take_task(cpu, edt);
@@ -3373,7 +4600,7 @@ asmlinkage void __sched schedule(void)
 	unsigned long *switch_count;
 	int deactivate, cpu;
 	struct rq *rq;
-	int injection_value;
+
 need_resched:
 	preempt_disable();
 
@@ -3387,6 +4614,9 @@ need_resched:
 	schedule_debug(prev);
 
 	grq_lock_irq();
+#ifdef CONFIG_HRM
+	hrm_fold_task(prev);
+#endif
 
 	switch_count = &prev->nivcsw;
 
@@ -3449,7 +4679,7 @@ need_resched:
 		if (needs_other_cpu(prev, cpu))
 			resched_suitable_idle(prev);
 		else if (!deactivate) {
-			if (!queued_notrunning()) {
+			if (!queued_notrunning() && !rq->idle_inject_forced) {
 				/*
 				* We now know prev is the only thing that is
 				* awaiting CPU so we can bypass rechecking for
@@ -3463,24 +4693,32 @@ need_resched:
 		}
 		return_task(prev, deactivate);
 	}
-	if(is_init == 1){
-		injection_value = param.global_rate;	
-		is_init=0;
-		set_everything_idlepar();	
-	}
-	else{
-		injection_value = param.global_rate;
+	if (unlikely(rq->idle_inject_req_us) && !rq->idle_inject_forced)
+		idle_inject_account(rq);
+	if (!rq->idle_inject_forced && idle_inject_due(rq)) {
+		rq->idle_inject_offset = 0;
+		if (queued_notrunning())
+			idle_inject_open_now(rq, rq->idle_inject_len_us);
 	}
 
-	idle_cycles_offset++;
-		
-	if (unlikely(!queued_notrunning()) || idle_cycles_offset == injection_value ){ 
+	if (unlikely(rq->idle_inject_forced)) {
+		/*
+		 * Inside an injected idle window. Don't advertise this CPU as
+		 * idle or every wakeup would try to preempt it for nothing,
+		 * and let an idle CPU pick up the task we just descheduled.
+		 */
+		if (prev != idle && !deactivate)
+			resched_suitable_idle(prev);
+		next = idle;
+		schedstat_inc(rq, sched_goidle);
+		clear_cpuidle_map(cpu);
+	} else if (unlikely(!queued_notrunning())) {
 		/*
 		 * This CPU is now truly idle as opposed to when idle is
 		 * scheduled as a high priority task in its own right.
 		 */
 			
-		idle_cycles_offset =0;
+		rq->idle_inject_offset = 0;
 		next = idle;
 		schedstat_inc(rq, sched_goidle);
 		set_cpuidle_map(cpu);
@@ -3651,20 +4889,56 @@ EXPORT_SYMBOL(default_wake_function);
  * There are circumstances in which we can try to wake a task which has already
  * started to run but is not in state TASK_RUNNING.  try_to_wake_up() returns
  * zero in this (rare) case, and we handle it by continuing to scan the queue.
+ *
+ * Once a task has been woken, the following waiters using
+ * default_wake_function() or autoremove_wake_function() are woken under a
+ * single grq lock hold, so a lone wakeup keeps the lockless idle kick of
+ * try_to_wake_up(). The lock is released before calling any other wake
+ * function as it may take it, and the idle CPUs claimed under it are kicked
+ * at the end, out of the lock.
  */
 static void __wake_up_common(wait_queue_head_t *q, unsigned int mode,
 			int nr_exclusive, int wake_flags, void *key)
 {
 	struct list_head *tmp, *next;
+	bool grq_locked = false;
+	unsigned long grq_flags;
+	cpumask_t kick;
+	int woken = 0;
+	int ret, cpu;
 
+	cpumask_clear(&kick);
 	list_for_each_safe(tmp, next, &q->task_list) {
 		wait_queue_t *curr = list_entry(tmp, wait_queue_t, task_list);
 		unsigned int flags = curr->flags;
 
-		if (curr->func(curr, mode, wake_flags, key) &&
-				(flags & WQ_FLAG_EXCLUSIVE) && !--nr_exclusive)
+		if (woken && (curr->func == default_wake_function ||
+			      curr->func == autoremove_wake_function)) {
+			if (!grq_locked) {
+				grq_lock_irqsave(&grq_flags);
+				grq_locked = true;
+			}
+			ret = try_to_wake_up_locked(curr->private, mode,
+						    wake_flags, &kick);
+			if (ret && curr->func == autoremove_wake_function)
+				list_del_init(&curr->task_list);
+		} else {
+			if (grq_locked) {
+				grq_unlock_irqrestore(&grq_flags);
+				grq_locked = false;
+			}
+			ret = curr->func(curr, mode, wake_flags, key);
+		}
+		if (ret)
+			woken++;
+		if (ret && (flags & WQ_FLAG_EXCLUSIVE) && !--nr_exclusive)
 			break;
 	}
+	if (grq_locked)
+		grq_unlock_irqrestore(&grq_flags);
+
+	for_each_cpu(cpu, &kick)
+		kick_idle_cpu(cpu);
 }
 
 /**
@@ -4914,8 +6188,14 @@ bool __sched yield_to(struct task_struct *p, bool preempt)
 	if (task_running(p) || p->state)
 		goto out_unlock;
 	yielded = 1;
-	if (p->deadline > rq->rq_deadline)
+	if (p->deadline > rq->rq_deadline) {
+		/* Keep the deadline tree in order */
+		if (task_queued(p))
+			edf_del_deadline(task_edf(p), p);
 		p->deadline = rq->rq_deadline;
+		if (task_queued(p))
+			edf_add_deadline(task_edf(p), p);
+	}
 	p->time_slice += rq->rq_time_slice;
 	rq->rq_time_slice = 0;
 	if (p->time_slice > timeslice())
@@ -5346,8 +6626,12 @@ int set_cpus_allowed_ptr(struct task_struct *p, const struct cpumask *new_mask)
 		set_task_cpu(p, cpumask_any_and(cpu_active_mask, new_mask));
 
 out:
-	if (queued)
+	if (queued) {
+		/* It may have to move in or out of a pinned queue */
+		dequeue_task(p);
+		enqueue_task(p);
 		try_preempt(p, rq);
+	}
 	task_grq_unlock(&flags);
 
 	if (running_wrong)
@@ -5367,6 +6651,11 @@ static void break_sole_affinity(int src_cpu, struct task_struct *idle)
 	do_each_thread(t, p) {
 		if (p != idle && !online_cpus(p)) {
 			cpumask_copy(tsk_cpus_allowed(p), cpu_possible_mask);
+			/* Out of the pinned queue of the dead cpu */
+			if (task_queued(p)) {
+				dequeue_task(p);
+				enqueue_task(p);
+			}
 			/*
 			 * Don't tell them about moving exiting tasks or
 			 * kernel threads (both mm NULL), since they never
@@ -5653,10 +6942,29 @@ migration_call(struct notifier_block *nfb, unsigned long action, void *hcpu)
 		}
 		grq.noc = num_online_cpus();
 		grq_unlock_irqrestore(&flags);
+		/* Arm any idle injection duty cycle set while it was offline */
+		smp_call_function_single(cpu, idle_inject_arm, rq, 1);
 		break;
 
 #ifdef CONFIG_HOTPLUG_CPU
+	case CPU_DOWN_PREPARE:
+		/*
+		 * The idle injection timers are pinned to the cpu and only
+		 * ever touch its rq: they must not follow it elsewhere.
+		 */
+		hrtimer_cancel(&rq->idle_inject_timer);
+		hrtimer_cancel(&rq->idle_inject_end_timer);
+		break;
+
+	case CPU_DOWN_FAILED:
+		smp_call_function_single(cpu, idle_inject_arm, rq, 1);
+		break;
+
 	case CPU_DEAD:
+		/* Either may have been started again since CPU_DOWN_PREPARE */
+		hrtimer_cancel(&rq->idle_inject_timer);
+		hrtimer_cancel(&rq->idle_inject_end_timer);
+		rq->idle_inject_forced = false;
 		/* Idle task back to normal (off runqueue, low prio) */
 		grq_lock_irq();
 		return_task(idle, 1);
@@ -7170,6 +8478,18 @@ void __init sched_init(void)
 		rq->user_pc = rq->nice_pc = rq->softirq_pc = rq->system_pc =
 			      rq->iowait_pc = rq->idle_pc = 0;
 		rq->dither = false;
+		rq->idle_inject_rate = param.global_rate;
+		rq->idle_inject_offset = 0;
+		rq->idle_inject_count = 0;
+		rq->idle_inject_us = rq->idle_inject_period_ms = 0;
+		rq->idle_inject_sync = 'n';
+		rq->idle_inject_min_state = 0;
+		rq->idle_inject_len_us = INJECTION_IDLE_LENGTH_US;
+		rq->idle_inject_forced = false;
+		rq->idle_inject_req_us = 0;
+		rq->idle_inject_req_ns = rq->idle_inject_act_ns = 0;
+		memset(rq->idle_inject_hist, 0, sizeof(rq->idle_inject_hist));
+		init_idle_inject_timers(rq);
 #ifdef CONFIG_SMP
 		rq->sticky_task = NULL;
 		rq->last_niffy = 0;
@@ -7178,6 +8498,7 @@ void __init sched_init(void)
 		rq->online = false;
 		rq->cpu = i;
 		rq_attach_root(rq, &def_root_domain);
+		init_edf_queue(&rq->pinned);
 #endif
 		atomic_set(&rq->nr_iowait, 0);
 	}
@@ -7214,10 +8535,7 @@ void __init sched_init(void)
 	}
 #endif
 
-	for (i = 0; i < PRIO_LIMIT; i++)
-		INIT_LIST_HEAD(grq.queue + i);
-	/* delimiter for bitsearch */
-	__set_bit(PRIO_LIMIT, grq.prio_bitmap);
+	init_edf_queue(&grq.edf);
 
 #ifdef CONFIG_PREEMPT_NOTIFIERS
 	INIT_HLIST_HEAD(&init_task.preempt_notifiers);
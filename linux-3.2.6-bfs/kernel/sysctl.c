@@ -126,6 +126,10 @@ static int __maybe_unused one_hundred = 100;
 extern int rr_interval;
 extern int sched_iso_cpu;
 static int __read_mostly one_thousand = 1000;
+#ifdef CONFIG_HRM
+extern int sched_hrm_boost;
+static int __read_mostly ninety = 90;
+#endif
 #endif
 #ifdef CONFIG_PRINTK
 static int ten_thousand = 10000;
@@ -867,6 +871,17 @@ static struct ctl_table kern_table[] = {
 		.extra1		= &zero,
 		.extra2		= &one_hundred,
 	},
+#ifdef CONFIG_HRM
+	{
+		.procname	= "hrm_boost",
+		.data		= &sched_hrm_boost,
+		.maxlen		= sizeof (int),
+		.mode		= 0644,
+		.proc_handler	= &proc_dointvec_minmax,
+		.extra1		= &zero,
+		.extra2		= &ninety,
+	},
+#endif
 #endif
 #if defined(CONFIG_S390) && defined(CONFIG_SMP)
 	{
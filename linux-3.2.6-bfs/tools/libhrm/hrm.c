@@ -10,12 +10,14 @@
  */
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/syscall.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <string.h>
 
@@ -75,8 +77,8 @@ int hrm_attach(hrm_t *monitor, int gid, bool consumer)
 	// attach thread to group
 	if (fprintf(group_fp, "%d", gid) < 0)
 		goto fprintf_group_failed;
-	// map thread counter
-	if (mmap(NULL, (size_t) page_size, PROT_READ | (consumer ? 0 : PROT_WRITE),
+	// map group counters, the kernel backs them with pages as the group grows
+	if (mmap(NULL, (size_t) page_size * HRM_GROUP_MAX_PAGES, PROT_READ | (consumer ? 0 : PROT_WRITE),
 				MAP_SHARED, counter_fd, 0) == MAP_FAILED)
 		goto mmap_counter_failed;
 	fscanf(counter_fp, "%lu", &counter_address);
@@ -88,6 +90,8 @@ int hrm_attach(hrm_t *monitor, int gid, bool consumer)
 
 	monitor->gid = gid;
 	monitor->consumer = consumer;
+	monitor->fd = consumer ? dup(measures_goal_fd) : -1;
+	monitor->last_beat = 0;
 	monitor->counter = (struct hrm_counter *) counter_address;
 	monitor->measures = (struct hrm_measures *) measures_address;
 	monitor->goal = (struct hrm_goal *) goal_address;
@@ -133,6 +137,8 @@ int hrm_detach(hrm_t *monitor)
 	setbuf(group_fp, NULL);
 	if (fprintf(group_fp, "-%d", monitor->gid) < 0)
 		goto fprintf_group_failed;
+	if (monitor->fd >= 0)
+		close(monitor->fd);
 
 	retval = 0;
 
@@ -272,6 +278,229 @@ int hrm_unset_goal(hrm_t *monitor)
 	return 0;
 }
 
+/* period_us 0 restores the default sampling period */
+int hrm_set_period(hrm_t *monitor, uint64_t period_us)
+{
+	if (!monitor) {
+		errno = EFAULT;
+		return -1;
+	}
+	if (monitor->consumer) {
+		errno = EPERM;
+		return -1;
+	}
+	if (period_us != 0 && (period_us < HRM_MIN_TIMER_PERIOD ||
+					period_us > HRM_MAX_TIMER_PERIOD)) {
+		errno = EDOM;
+		return -1;
+	}
+
+	while (__sync_lock_test_and_set(&monitor->goal->goal_lock, 1));
+	monitor->goal->period_us = period_us;
+	__sync_lock_release(&monitor->goal->goal_lock);
+
+	return 0;
+}
+
+/* threshold 0 only wakes hrm_wait() when the goal is missed or met again */
+int hrm_set_notify_threshold(hrm_t *monitor, double threshold)
+{
+	if (!monitor) {
+		errno = EFAULT;
+		return -1;
+	}
+	if (threshold < 0) {
+		errno = EDOM;
+		return -1;
+	}
+
+	while (__sync_lock_test_and_set(&monitor->goal->goal_lock, 1));
+	monitor->goal->notify_threshold = (uint64_t) (threshold *
+							HRM_MEASURE_SCALE);
+	__sync_lock_release(&monitor->goal->goal_lock);
+
+	return 0;
+}
+
+/* p99_ns 0 removes the bound on the 99th percentile of the heartbeat gaps */
+int hrm_set_max_gap(hrm_t *monitor, uint64_t p99_ns)
+{
+	if (!monitor) {
+		errno = EFAULT;
+		return -1;
+	}
+	if (monitor->consumer) {
+		errno = EPERM;
+		return -1;
+	}
+
+	while (__sync_lock_test_and_set(&monitor->goal->goal_lock, 1));
+	monitor->goal->max_gap_p99 = p99_ns;
+	__sync_lock_release(&monitor->goal->goal_lock);
+
+	return 0;
+}
+
+/*
+ * Sleeps until the heart rate in the goal scope leaves or re-enters the
+ * goal, or a window moves by more than the notify threshold; timeout_ms -1
+ * waits forever. Returns 1 on an event and 0 on timeout.
+ */
+int hrm_wait(hrm_t *monitor, int timeout_ms)
+{
+	struct pollfd pfd;
+	char buf[64];
+	int retval;
+
+	if (!monitor) {
+		errno = EFAULT;
+		return -1;
+	}
+	if (!monitor->consumer || monitor->fd < 0) {
+		errno = EPERM;
+		return -1;
+	}
+
+	pfd.fd = monitor->fd;
+	pfd.events = POLLIN | POLLPRI;
+	retval = poll(&pfd, 1, timeout_ms);
+	if (retval <= 0)
+		return retval;
+	if (pfd.revents & POLLERR) {
+		errno = EPERM;
+		return -1;
+	}
+	// acknowledge the event
+	if (pread(monitor->fd, buf, sizeof(buf), 0) < 0)
+		return -1;
+
+	return 1;
+}
+
+/*
+ * Takes a consistent copy of a measure: the kernel makes measures->seq odd
+ * while it rewrites the measures, so readers never wait on each other.
+ */
+static double __hrm_read_heart_rate(const hrm_t *monitor,
+					const struct hrm_measure *measure)
+{
+	volatile const uint32_t *seq = &monitor->measures->seq;
+	uint32_t begin;
+	uint64_t count, time;
+
+	do {
+		while ((begin = *seq) & 1)
+			;
+		__sync_synchronize();
+		count = measure->count;
+		time = measure->time;
+		__sync_synchronize();
+	} while (*seq != begin);
+
+	if (!time)
+		return 0;
+
+	return ((double) count / (double) time) * NSEC_PER_SEC;
+}
+
+/* half_life is in sampling periods, the key of the estimator is returned */
+int hrm_add_ewma(hrm_t *monitor, unsigned int half_life)
+{
+	int i;
+
+	if (!monitor) {
+		errno = EFAULT;
+		return -1;
+	}
+	if (half_life == 0 || half_life > HRM_MAX_WINDOW_SIZE) {
+		errno = EDOM;
+		return -1;
+	}
+
+	while (__sync_lock_test_and_set(&monitor->goal->goal_lock, 1));
+	for (i = 0; i < HRM_MAX_EWMAS; i++) {
+		if (monitor->goal->ewma_half_life[i] == half_life)
+			break;
+		if (monitor->goal->ewma_half_life[i] == 0) {
+			monitor->goal->ewma_half_life[i] = half_life;
+			break;
+		}
+	}
+	__sync_lock_release(&monitor->goal->goal_lock);
+
+	if (i == HRM_MAX_EWMAS) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	return i + 1;
+}
+
+int hrm_del_ewma(hrm_t *monitor, unsigned int half_life)
+{
+	int i;
+
+	if (!monitor) {
+		errno = EFAULT;
+		return -1;
+	}
+	if (monitor->consumer) {
+		errno = EPERM;
+		return -1;
+	}
+	if (half_life == 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	while (__sync_lock_test_and_set(&monitor->goal->goal_lock, 1));
+	for (i = 0; i < HRM_MAX_EWMAS; i++) {
+		if (monitor->goal->ewma_half_life[i] == half_life) {
+			monitor->goal->ewma_half_life[i] = 0;
+			break;
+		}
+	}
+	__sync_lock_release(&monitor->goal->goal_lock);
+
+	if (i == HRM_MAX_EWMAS) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Smoothed heart rate [hb/s] and, if trend is not NULL, its trend [hb/s^2] */
+double hrm_get_ewma(const hrm_t *monitor, int key, double *trend)
+{
+	volatile const uint32_t *seq;
+	uint32_t begin;
+	struct hrm_ewma ewma;
+
+	if (!monitor) {
+		errno = EFAULT;
+		return 0;
+	}
+	if (key < 1 || key > HRM_MAX_EWMAS) {
+		errno = EINVAL;
+		return 0;
+	}
+
+	seq = &monitor->measures->seq;
+	do {
+		while ((begin = *seq) & 1)
+			;
+		__sync_synchronize();
+		ewma = monitor->measures->ewma[key - 1];
+		__sync_synchronize();
+	} while (*seq != begin);
+
+	if (trend)
+		*trend = (double) ewma.trend / HRM_MEASURE_SCALE;
+
+	return (double) ewma.rate / HRM_MEASURE_SCALE;
+}
+
 int hrm_get_windows_number(hrm_t *monitor)
 {
 	int count = 0;
@@ -306,7 +535,6 @@ size_t hrm_get_window_size(hrm_t *monitor, int key)
 double hrm_seek_heart_rate(const hrm_t *monitor, size_t window_size, int *key)
 {
 	int i;
-	double hr = 0;
 
 	if (!monitor) {
 		errno = EFAULT;
@@ -321,27 +549,14 @@ double hrm_seek_heart_rate(const hrm_t *monitor, size_t window_size, int *key)
 
 	if (window_size == 0) {
 		*key = 0;
-		while (__sync_lock_test_and_set(&monitor->goal->goal_lock, 1));
-		if (monitor->measures->global.time)
-			hr = ((double) monitor->measures->global.count /
-				(double) monitor->measures->global.time) *
-								NSEC_PER_SEC;
-		__sync_lock_release(&monitor->goal->goal_lock);
-
-		return hr;
+		return __hrm_read_heart_rate(monitor, &monitor->measures->global);
 	}
 
-	while (__sync_lock_test_and_set(&monitor->goal->goal_lock, 1));
 	for(i = 0; i < HRM_MAX_WINDOWS; i++)
 		if (monitor->goal->window_size[i] == window_size) {
 			*key = i + 1;
 			break;
 		}
-	if (monitor->measures->window[i].time)
-		hr = ((double) monitor->measures->window[i].count /
-			(double) monitor->measures->window[i].time) *
-								NSEC_PER_SEC;
-	__sync_lock_release(&monitor->goal->goal_lock);
 
 	if (i == HRM_MAX_WINDOWS) {
 		errno = EINVAL;
@@ -349,7 +564,7 @@ double hrm_seek_heart_rate(const hrm_t *monitor, size_t window_size, int *key)
 		return 0;
 	}
 
-	return hr;
+	return __hrm_read_heart_rate(monitor, &monitor->measures->window[i]);
 }
 
 double hrm_get_heart_rate(const hrm_t *monitor, size_t *window_size, int key)
@@ -369,26 +584,16 @@ double hrm_get_heart_rate(const hrm_t *monitor, size_t *window_size, int key)
 
 	if (key == 0) {
 		*window_size = 0;
-		while (__sync_lock_test_and_set(&monitor->goal->goal_lock, 1));
-		if (monitor->measures->global.time)
-			hr = ((double) monitor->measures->global.count /
-				(double) monitor->measures->global.time) *
-								NSEC_PER_SEC;
-		__sync_lock_release(&monitor->goal->goal_lock);
-
-		return hr;
+		return __hrm_read_heart_rate(monitor, &monitor->measures->global);
 	}
 
-	while (__sync_lock_test_and_set(&monitor->goal->goal_lock, 1));
 	*window_size = monitor->goal->window_size[key - 1];
 	if (!*window_size) {
 		errno = EINVAL;
 		*window_size = HRM_MAX_WINDOW_SIZE;
-	} else if (monitor->measures->window[key - 1].time)
-		hr = ((double) monitor->measures->window[key - 1].count /
-			(double) monitor->measures->window[key - 1].time) *
-								NSEC_PER_SEC;
-	__sync_lock_release(&monitor->goal->goal_lock);
+	} else
+		hr = __hrm_read_heart_rate(monitor,
+					&monitor->measures->window[key - 1]);
 
 	return hr;
 }
@@ -431,8 +636,52 @@ hrm_get_max_heart_rate(const hrm_t *monitor, size_t *window_size)
 	return hr;
 }
 
+/* Percentiles of the heartbeat gaps in the goal scope [ns] */
+int hrm_get_gaps(const hrm_t *monitor, uint64_t *p50, uint64_t *p99,
+							uint64_t *p999)
+{
+	volatile const uint32_t *seq;
+	uint32_t begin;
+
+	if (!monitor) {
+		errno = EFAULT;
+		return -1;
+	}
+
+	seq = &monitor->measures->seq;
+	do {
+		while ((begin = *seq) & 1)
+			;
+		__sync_synchronize();
+		*p50 = monitor->measures->gap_p50;
+		*p99 = monitor->measures->gap_p99;
+		*p999 = monitor->measures->gap_p999;
+		__sync_synchronize();
+	} while (*seq != begin);
+
+	return 0;
+}
+
+/* Bucket of struct hrm_gaps for a gap of us microseconds */
+static int __hrm_gap_bucket(uint64_t us)
+{
+	int order;
+
+	if (us < 4)
+		return us;
+	order = 63 - __builtin_clzll(us);
+	if (order >= HRM_GAP_BUCKETS / 4 + 1)
+		return HRM_GAP_BUCKETS - 1;
+
+	return (order - 1) * 4 + ((us >> (order - 2)) & 3);
+}
+
 int heartbeat(hrm_t *monitor, uint64_t n)
 {
+	struct hrm_gaps *gaps;
+	struct timespec now;
+	uint64_t beat;
+
 	if (!monitor) {
 		errno = EFAULT;
 		return -1;
@@ -444,6 +693,16 @@ int heartbeat(hrm_t *monitor, uint64_t n)
 
 	__sync_add_and_fetch(&monitor->counter->counter, n);
 
+	// count n gaps evenly spread since the previous heartbeat
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	beat = (uint64_t) now.tv_sec * NSEC_PER_SEC + now.tv_nsec;
+	if (monitor->last_beat && n) {
+		gaps = (struct hrm_gaps *) (monitor->measures + 1);
+		__sync_add_and_fetch(&gaps->bucket[__hrm_gap_bucket(
+			(beat - monitor->last_beat) / n / 1000)], n);
+	}
+	monitor->last_beat = beat;
+
 	return 0;
 }
 
@@ -452,6 +711,7 @@ int hrm_get_tids(const hrm_t *monitor, pid_t tids[], int n)
 	pid_t *tids_;
 	int tids_count = 0;
 	struct hrm_counter *counter;
+	uint64_t counters;
 
 	if (!monitor) {
 		errno = EFAULT;
@@ -464,10 +724,11 @@ int hrm_get_tids(const hrm_t *monitor, pid_t tids[], int n)
 	if (tids == NULL)
 		return -1;
 
-	tids_ = (pid_t *) calloc(64, sizeof(pid_t));
+	counters = monitor->measures->counters;
+	tids_ = (pid_t *) calloc(counters, sizeof(pid_t));
 	if (tids_ == NULL)
 		return -1;
-	for (int i = 0; i < 64; i++) {
+	for (uint64_t i = 0; i < counters; i++) {
 		counter = (struct hrm_counter *)
 				((unsigned long) monitor->counter + i * 64);
 		if (counter->used)
@@ -24,6 +24,8 @@ extern "C" {
 struct hrm {
 	int gid;
 	bool consumer;
+	int fd; /* measures and goal file of consumers, see hrm_wait() */
+	uint64_t last_beat; /* [ns], see heartbeat() */
 
 	struct hrm_counter *counter;
 	struct hrm_measures *measures;
@@ -43,6 +45,16 @@ hrm_set_goal(hrm_t *monitor, size_t window_size, double min_heart_rate,
 							double max_heart_rate);
 int hrm_unset_goal(hrm_t *monitor);
 
+int hrm_set_period(hrm_t *monitor, uint64_t period_us);
+int hrm_set_notify_threshold(hrm_t *monitor, double threshold);
+int hrm_set_max_gap(hrm_t *monitor, uint64_t p99_ns);
+
+int hrm_wait(hrm_t *monitor, int timeout_ms);
+
+int hrm_add_ewma(hrm_t *monitor, unsigned int half_life);
+int hrm_del_ewma(hrm_t *monitor, unsigned int half_life);
+double hrm_get_ewma(const hrm_t *monitor, int key, double *trend);
+
 int hrm_get_windows_number(hrm_t *monitor);
 size_t hrm_get_window_size(hrm_t *monitor, int key);
 
@@ -54,6 +66,9 @@ hrm_get_min_heart_rate(const hrm_t *monitor, size_t *window_size);
 double
 hrm_get_max_heart_rate(const hrm_t *monitor, size_t *window_size);
 
+int hrm_get_gaps(const hrm_t *monitor, uint64_t *p50, uint64_t *p99,
+							uint64_t *p999);
+
 int hrm_get_tids(const hrm_t *monitor, pid_t tids[], int n);
 
 int heartbeat(hrm_t *monitor, uint64_t n);
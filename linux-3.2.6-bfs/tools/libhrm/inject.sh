@@ -7,5 +7,5 @@ do
 done
 for (( i=$1 ; $i< $2+1 ; i= $i+1 ))  
 do
-	echo $i,$3,t > /proc/schedidle/sched_pid
+	echo $i,$3,t,${4:-i} > /proc/schedidle/sched_pid
 done